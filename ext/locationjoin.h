@@ -0,0 +1,116 @@
+#ifndef LOCATION_JOIN_H
+#define LOCATION_JOIN_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/way.hpp>
+
+namespace GeoUtils {
+
+// looks up the locations of a batch of way node references with one forward
+// sweep over a sorted location index, rather than a binary search over the
+// whole index for each reference. References are added in any order, sorted
+// by id on resolve and matched by galloping through the index, locations are
+// then read back in the order they were added. The index needs to be sorted,
+// as a SparseMemArray is after sort(). Negative references are looked up by
+// their absolute id in an index of their own, when one is given
+template <typename TIndex> class LocationJoin {
+public:
+  explicit LocationJoin(const TIndex &index,
+                        const TIndex *negativeIndex = nullptr)
+      : mIndex(index), mNegativeIndex(negativeIndex) {}
+
+  // starts a new batch, keeps the memory of the last one
+  void clear() {
+    mRefs.clear();
+    mNegativeRefs.clear();
+    mLocations.clear();
+    mCount = 0;
+  }
+
+  void add(osmium::object_id_type ref) {
+    if (ref >= 0) {
+      mRefs.emplace_back(osmium::unsigned_object_id_type(ref), mCount++);
+    } else {
+      mNegativeRefs.emplace_back(osmium::unsigned_object_id_type(-ref),
+                                 mCount++);
+    }
+  }
+
+  void add(const osmium::Way &way) {
+    for (const auto &node : way.nodes()) {
+      add(node.ref());
+    }
+  }
+
+  // references not in the index get an undefined location
+  void resolve() {
+
+    mLocations.assign(mCount, osmium::Location());
+    sweep(mIndex, mRefs);
+    if (mNegativeIndex) {
+      sweep(*mNegativeIndex, mNegativeRefs);
+    }
+  }
+
+  // location of the reference added at this position
+  const osmium::Location &location(size_t i) const { return mLocations[i]; }
+  const osmium::Location *locations() const { return mLocations.data(); }
+  size_t size() const { return mCount; }
+
+protected:
+  using RefList =
+      std::vector<std::pair<osmium::unsigned_object_id_type, size_t>>;
+
+  void sweep(const TIndex &index, RefList &refs) {
+
+    std::sort(refs.begin(), refs.end());
+
+    auto it = index.cbegin();
+    auto end = index.cend();
+
+    for (const auto &ref : refs) {
+      it = gallop(it, end, ref.first);
+      if (it == end) {
+        break;
+      }
+      if (it->first == ref.first) {
+        mLocations[ref.second] = it->second;
+      }
+    }
+  }
+
+  // first element at or after it with an id not less than the one given,
+  // stepping out in doubling strides before bisecting the last one
+  template <typename TIterator>
+  static TIterator gallop(TIterator it, TIterator end,
+                          osmium::unsigned_object_id_type id) {
+
+    auto less = [](const auto &element, osmium::unsigned_object_id_type id) {
+      return element.first < id;
+    };
+
+    size_t step = 1;
+    while (step < size_t(end - it) && less(*(it + step), id)) {
+      it += step;
+      step *= 2;
+    }
+    return std::lower_bound(it, it + std::min(step, size_t(end - it)), id,
+                            less);
+  }
+
+  const TIndex &mIndex;
+  const TIndex *mNegativeIndex;
+  RefList mRefs;
+  RefList mNegativeRefs;
+  size_t mCount = 0;
+  std::vector<osmium::Location> mLocations;
+};
+
+} // namespace GeoUtils
+
+#endif
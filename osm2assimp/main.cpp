@@ -8,6 +8,7 @@
 #include "convertlatlng.h"
 #include "eigenconversion.h"
 #include "geometry.h"
+#include "locationjoin.h"
 #include "s2util.h"
 #include "sceneconstruct.h"
 #include "utils.h"
@@ -18,11 +19,11 @@
 #include <iostream>
 #include <map>
 #include <string.h>
+#include <string>
 #include <vector>
 
 #include <osmium/geom/coordinates.hpp>
 #include <osmium/geom/mercator_projection.hpp>
-#include <osmium/handler/node_locations_for_ways.hpp>
 #include <osmium/index/map/dense_file_array.hpp>
 #include <osmium/index/map/sparse_mem_array.hpp>
 #include <osmium/io/any_input.hpp>
@@ -32,7 +33,6 @@
 using index_type =
     osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type,
                                        osmium::Location>;
-using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
 
 using std::cout;
 using std::endl;
@@ -56,6 +56,67 @@ using GeoUtils::SceneConstruct;
 using GeoUtils::TypeFilter;
 using GeoUtils::ViewFilterList;
 
+// pbf written with the node locations on the ways, like osmsplit's
+// --locations-on-ways leaves, needs no location index
+bool hasLocationsOnWays(const osmium::io::Header &header) {
+  for (int i = 0;; i++) {
+    auto feature = header.get("pbf_optional_feature_" + std::to_string(i));
+    if (feature.empty()) {
+      return false;
+    }
+    if (feature == "LocationsOnWays") {
+      return true;
+    }
+  }
+}
+
+// nodes go into the index as they're read, each buffer of ways then gets its
+// locations from one sorted sweep of it. Negative ids, from editors like
+// JOSM, have an index of their own. Nodes that aren't in the input are left
+// without a location, which the features skip
+void applyWithLocations(osmium::io::Reader &reader, SceneConstruct &scene) {
+
+  index_type index;
+  index_type negativeIndex;
+  GeoUtils::LocationJoin<index_type> join(index, &negativeIndex);
+  bool sorted = false;
+
+  while (osmium::memory::Buffer buffer = reader.read()) {
+
+    for (const auto &node : buffer.select<osmium::Node>()) {
+      auto &nodes = node.id() < 0 ? negativeIndex : index;
+      nodes.set(node.positive_id(), node.location());
+    }
+
+    auto ways = buffer.select<osmium::Way>();
+    if (ways.begin() != ways.end()) {
+
+      // the input has its nodes before its ways
+      if (!sorted) {
+        index.sort();
+        negativeIndex.sort();
+        sorted = true;
+      }
+
+      join.clear();
+      for (const auto &way : ways) {
+        join.add(way);
+      }
+      join.resolve();
+
+      size_t i = 0;
+      for (auto &way : ways) {
+        for (auto &node : way.nodes()) {
+          node.set_location(join.location(i++));
+        }
+      }
+    }
+
+    osmium::apply(buffer, scene);
+  }
+  reader.close();
+}
+
 int main(int argi, char **argc) {
 
   cout << "Running osm2assimp " << endl;
@@ -270,18 +331,15 @@ int main(int argi, char **argc) {
       exit(1);
     }
 
-    index_type index;
-
-    location_handler_type locationHandler{index};
-
     try {
 
       osmium::io::Reader osmFileReader{inputFile,
                                        osmium::osm_entity_bits::node |
                                            osmium::osm_entity_bits::way};
 
+      osmium::io::Header header = osmFileReader.header();
+
       if (!box.valid()) {
-        osmium::io::Header header = osmFileReader.header();
         box = header.box();
 
         if (!box.valid() && !refPointArg) {
@@ -301,7 +359,11 @@ int main(int argi, char **argc) {
       }
 
       // this is where it all happens
-      osmium::apply(osmFileReader, locationHandler, sceneConstruct);
+      if (hasLocationsOnWays(header)) {
+        osmium::apply(osmFileReader, sceneConstruct);
+      } else {
+        applyWithLocations(osmFileReader, sceneConstruct);
+      }
 
       cout << "Ways Exported: " << sceneConstruct.wayCount() << endl;
     } catch (const std::system_error &err) {
@@ -147,6 +147,11 @@ namespace GeoUtils
 
     for (auto node : way.nodes())
     {
+      // nodes missing from the input
+      if (!node.location().valid())
+      {
+        continue;
+      }
 
       osmium::geom::Coordinates c = ConvertLatLngToCoords::to_coords(node.location());
 
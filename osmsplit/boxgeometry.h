@@ -0,0 +1,59 @@
+#ifndef BOX_GEOMETRY_H
+#define BOX_GEOMETRY_H
+
+#include <algorithm>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+
+namespace GeoUtils {
+
+// whether two boxes share any point, boundaries included
+inline bool boxesOverlap(const osmium::Box &a, const osmium::Box &b) {
+  return a.valid() && b.valid() &&
+         a.bottom_left().x() <= b.top_right().x() &&
+         a.bottom_left().y() <= b.top_right().y() &&
+         a.top_right().x() >= b.bottom_left().x() &&
+         a.top_right().y() >= b.bottom_left().y();
+}
+
+// whether the segment from a to b passes through the box, boundary included.
+// Liang-Barsky
+inline bool segmentInBox(const osmium::Location &a, const osmium::Location &b,
+                         const osmium::Box &box) {
+
+  double x0 = a.x();
+  double y0 = a.y();
+  double dx = double(b.x()) - x0;
+  double dy = double(b.y()) - y0;
+  double t0 = 0;
+  double t1 = 1;
+
+  auto clip = [&](double p, double q) {
+    if (p == 0) {
+      return q >= 0;
+    }
+    double r = q / p;
+    if (p < 0) {
+      if (r > t1) {
+        return false;
+      }
+      t0 = std::max(t0, r);
+    } else {
+      if (r < t0) {
+        return false;
+      }
+      t1 = std::min(t1, r);
+    }
+    return true;
+  };
+
+  return clip(-dx, x0 - box.bottom_left().x()) &&
+         clip(dx, box.top_right().x() - x0) &&
+         clip(-dy, y0 - box.bottom_left().y()) &&
+         clip(dy, box.top_right().y() - y0);
+}
+
+} // namespace GeoUtils
+
+#endif
@@ -0,0 +1,262 @@
+#include "changeapplier.h"
+
+#include <osmium/builder/attr.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/io/any_output.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using std::cout;
+using std::endl;
+
+namespace GeoUtils {
+
+using namespace osmium::builder::attr;
+
+const size_t changeBufferSize = 1024 * 1024;
+
+// leaves split with --locations-on-ways
+static bool hasLocationsOnWays(const osmium::io::Header &header) {
+  for (int i = 0;; i++) {
+    auto feature = header.get("pbf_optional_feature_" + std::to_string(i));
+    if (feature.empty()) {
+      return false;
+    }
+    if (feature == "LocationsOnWays") {
+      return true;
+    }
+  }
+}
+
+ChangeApplier::ChangeApplier(const MappedSplitTree &tree,
+                             const fs::path &leafDirectory, SplitIndex &index)
+    : mTree(tree), mLeafDirectory(leafDirectory), mIndex(index),
+      mChanges(changeBufferSize, osmium::memory::Buffer::auto_grow::yes) {}
+
+size_t ChangeApplier::apply(const fs::path &changeFile) {
+
+  osmium::io::Reader reader{osmium::io::File(changeFile.string()),
+                            osmium::osm_entity_bits::node |
+                                osmium::osm_entity_bits::way};
+
+  while (osmium::memory::Buffer buffer = reader.read()) {
+    mChanges.add_buffer(buffer);
+    mChanges.commit();
+  }
+  reader.close();
+
+  // only taken once the buffer has stopped growing
+  for (const auto &node : mChanges.select<osmium::Node>()) {
+    auto &latest = mNodes[node.positive_id()];
+    if (!latest || node.version() >= latest->version()) {
+      latest = &node;
+    }
+  }
+  for (const auto &way : mChanges.select<osmium::Way>()) {
+    auto &latest = mWays[way.positive_id()];
+    if (!latest || way.version() >= latest->version()) {
+      latest = &way;
+    }
+  }
+
+  cout << tfm::format("Changes : %d nodes, %d ways", mNodes.size(),
+                      mWays.size())
+       << endl;
+
+  route();
+
+  for (auto leaf : mAffected) {
+    rewriteLeaf(leaf);
+  }
+
+  mIndex.save();
+
+  return mAffected.size();
+}
+
+void ChangeApplier::route() {
+
+  std::vector<LeafId> found;
+
+  for (const auto &[id, node] : mNodes) {
+
+    mTree.leavesForLocation(mIndex.location(id), found);
+    mAffected.insert(found.begin(), found.end());
+
+    mIndex.setLocation(id, node->visible() ? node->location()
+                                           : osmium::Location());
+  }
+
+  // boxes of the new versions use the node locations updated above
+
+  for (const auto &[id, way] : mWays) {
+
+    mTree.leavesForBox(mIndex.wayBox(id), found);
+    mAffected.insert(found.begin(), found.end());
+
+    osmium::Box box;
+    if (way->visible()) {
+      for (const auto &node : way->nodes()) {
+        box.extend(mIndex.location(node.positive_ref()));
+      }
+    }
+
+    mTree.leavesForBox(box, found);
+    for (auto leaf : found) {
+      mAffected.insert(leaf);
+      mLeafWays[leaf].push_back(way);
+    }
+
+    mIndex.setWayBox(id, box);
+  }
+}
+
+void ChangeApplier::rewriteLeaf(LeafId leaf) {
+
+  fs::path leafFile = mLeafDirectory / fs::path(mTree.leafFileName(leaf));
+
+  cout << "Updating " << leafFile << endl;
+
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<osmium::memory::Buffer> buffers;
+  bool locationsOnWays = false;
+  if (fs::exists(leafFile)) {
+    osmium::io::Reader reader{osmium::io::File(leafFile.string()),
+                              osmium::osm_entity_bits::node |
+                                  osmium::osm_entity_bits::way};
+    locationsOnWays = hasLocationsOnWays(reader.header());
+    while (osmium::memory::Buffer buffer = reader.read()) {
+      buffers.push_back(std::move(buffer));
+    }
+    reader.close();
+  }
+
+  // the leaf's ways that didn't change and the changed ones that belong.
+  // Leaves with the locations on their ways have no nodes to take them from
+  NodeLocations leafNodes;
+  std::vector<const osmium::Way *> ways;
+
+  for (auto &buffer : buffers) {
+    for (const auto &node : buffer.select<osmium::Node>()) {
+      leafNodes.set(node.id(), node.location());
+    }
+    for (const auto &way : buffer.select<osmium::Way>()) {
+      if (mWays.find(way.positive_id()) == mWays.end()) {
+        ways.push_back(&way);
+      }
+      if (locationsOnWays) {
+        for (const auto &node : way.nodes()) {
+          if (node.location().valid()) {
+            leafNodes.set(node.ref(), node.location());
+          }
+        }
+      }
+    }
+  }
+  leafNodes.sort();
+
+  auto changed = mLeafWays.find(leaf);
+  if (changed != mLeafWays.end()) {
+    ways.insert(ways.end(), changed->second.begin(), changed->second.end());
+  }
+
+  std::sort(ways.begin(), ways.end(), [](const auto *a, const auto *b) {
+    return a->positive_id() < b->positive_id();
+  });
+
+  std::vector<osmium::object_id_type> refs;
+  for (auto way : ways) {
+    for (const auto &node : way->nodes()) {
+      refs.push_back(node.ref());
+    }
+  }
+  std::sort(refs.begin(), refs.end());
+  refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+
+  osmium::memory::Buffer nodeBuffer{changeBufferSize,
+                                    osmium::memory::Buffer::auto_grow::yes};
+  osmium::memory::Buffer wayBuffer{changeBufferSize,
+                                   osmium::memory::Buffer::auto_grow::yes};
+  osmium::Box contentBox;
+  uint64_t nodeCount = 0;
+  NodeLocations onWays;
+
+  for (auto ref : refs) {
+
+    // changed nodes have their new location in the index, nodes new to the
+    // leaf are taken from the index too. Negative ids are only ever the
+    // leaf's own, neither changes nor the index have them
+    osmium::Location loc;
+    if (ref < 0 || mNodes.find(ref) == mNodes.end()) {
+      loc = leafNodes.get_noexcept(ref);
+    }
+    if (!loc.valid() && ref >= 0) {
+      loc = mIndex.location(ref);
+    }
+    if (!loc.valid()) {
+      continue;
+    }
+
+    contentBox.extend(loc);
+    if (locationsOnWays) {
+      onWays.set(ref, loc);
+    } else {
+      osmium::builder::add_node(nodeBuffer, _id(ref), _location(loc));
+      nodeCount++;
+    }
+  }
+
+  for (auto way : ways) {
+    wayBuffer.add_item(*way);
+    wayBuffer.commit();
+  }
+
+  if (locationsOnWays) {
+    onWays.sort();
+    for (auto &way : wayBuffer.select<osmium::Way>()) {
+      for (auto &node : way.nodes()) {
+        node.set_location(onWays.get_noexcept(node.ref()));
+      }
+    }
+  }
+
+  std::string format = "pbf";
+  if (locationsOnWays) {
+    format += ",locations_on_ways=true";
+  }
+
+  osmium::io::Header header;
+  header.set("generator", "osmsplit");
+  header.add_box(mTree.leafBox(leaf));
+
+  // written beside the leaf and moved over it, so a failure leaves the old one
+  fs::path tmp = leafFile.string() + ".tmp";
+  {
+    osmium::io::Writer writer{osmium::io::File(tmp.string(), format), header,
+                              osmium::io::overwrite::allow};
+    if (!locationsOnWays) {
+      writer(std::move(nodeBuffer));
+    }
+    writer(std::move(wayBuffer));
+    writer.close();
+  }
+  fs::rename(tmp, leafFile);
+
+  // which changed ways are shared isn't known, the count from the split is
+  // kept
+  LeafStats stats = mTree.leafStats(leaf);
+  stats.bytes = fs::file_size(leafFile);
+  stats.nodes = nodeCount;
+  stats.ways = ways.size();
+  stats.writeSeconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  mUpdates[leaf] = {contentBox, stats};
+}
+
+} // namespace GeoUtils
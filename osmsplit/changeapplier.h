@@ -0,0 +1,66 @@
+#ifndef CHANGE_APPLIER_H
+#define CHANGE_APPLIER_H
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "mappedsplittree.h"
+#include "osmsplitconfig.h"
+#include "splitindex.h"
+
+namespace GeoUtils {
+
+// brings the leaves of an earlier split up to date with an osm change file,
+// rewriting only the leaves the changes touch. Changed ways go to the leaves
+// of their old and new boxes, from the index. Moved or deleted nodes go to
+// the leaves whose content box held their old location, which covers every
+// leaf holding a copy of them. Routed with the mapped split tree, so the
+// config isn't needed until the rewritten leaves are saved to it. Ways that
+// aren't in the change keep their leaves even when their nodes move, and
+// relations are ignored as they are when splitting. Leaves written with the
+// locations on their ways are rewritten that way
+class ChangeApplier {
+public:
+  using LeafId = MappedSplitTree::LeafId;
+
+  // the new content box and stats of a rewritten leaf
+  struct LeafUpdate {
+    osmium::Box contentBox;
+    LeafStats stats;
+  };
+
+  ChangeApplier(const MappedSplitTree &tree, const fs::path &leafDirectory,
+                SplitIndex &index);
+
+  // returns the number of leaves rewritten
+  size_t apply(const fs::path &changeFile);
+
+  const std::map<LeafId, LeafUpdate> &updates() const { return mUpdates; }
+
+protected:
+  void route();
+  void rewriteLeaf(LeafId leaf);
+
+  const MappedSplitTree &mTree;
+  fs::path mLeafDirectory;
+  SplitIndex &mIndex;
+
+  osmium::memory::Buffer mChanges;
+
+  // latest version of each changed object
+  std::map<osmium::unsigned_object_id_type, const osmium::Node *> mNodes;
+  std::map<osmium::unsigned_object_id_type, const osmium::Way *> mWays;
+
+  std::set<LeafId> mAffected;
+  std::map<LeafId, std::vector<const osmium::Way *>> mLeafWays;
+  std::map<LeafId, LeafUpdate> mUpdates;
+};
+
+} // namespace GeoUtils
+
+#endif
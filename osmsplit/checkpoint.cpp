@@ -0,0 +1,281 @@
+#include "checkpoint.h"
+#include "splitindex.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/ostreamwrapper.h>
+#include <rapidjson/prettywriter.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace GeoUtils {
+
+static bool readJson(const fs::path &file, rapidjson::Document &d) {
+
+  std::ifstream in(file);
+  if (!in) {
+    return false;
+  }
+  std::stringstream ss;
+  ss << in.rdbuf();
+
+  return !d.Parse<0>(ss.str().c_str()).HasParseError() && d.IsObject();
+}
+
+// written next to the file and moved over it, so a run killed part way
+// through leaves the last one whole
+static void writeJson(const fs::path &file, rapidjson::Document &d) {
+
+  fs::path tmp = file.string() + ".tmp";
+  {
+    std::ofstream out(tmp);
+    rapidjson::OStreamWrapper osw(out);
+    rapidjson::PrettyWriter<rapidjson::OStreamWrapper> writer(osw);
+    d.Accept(writer);
+  }
+  fs::rename(tmp, file);
+}
+
+// only the tests set this, to exit as if killed after so many checkpoints
+static int stopAfterCheckpoints() {
+  const char *value = std::getenv("OSMSPLIT_STOP_AFTER_CHECKPOINTS");
+  return value ? std::atoi(value) : 0;
+}
+
+// the options that change the plan or the leaves written, a checkpoint
+// taken with others can't be carried on from
+static std::string outputOptions(const SplitOptions &options) {
+  const auto &cost = options.costModel;
+  return tfm::format("levels=%d sampleRate=%d samples=%d precision=%d "
+                     "weights=%g,%g,%g,%g clip=%d locationsOnWays=%d "
+                     "compression=%d blobEntities=%d join=%d",
+                     options.depthLevels, options.sampleRate,
+                     options.sampleBudget, options.histogramPrecision,
+                     cost.nodeWeight, cost.wayWeight, cost.byteWeight,
+                     cost.duplicateWeight, options.clipWays,
+                     options.locationsOnWays, options.compressionLevel,
+                     options.blobEntities, options.joinLocations);
+}
+
+Checkpoint::Checkpoint(const fs::path &directory, const fs::path &inputFile,
+                       const SplitOptions &options)
+    : mDirectory(directory), mOptions(outputOptions(options)),
+      mInterval(options.checkpointSeconds),
+      mLast(std::chrono::steady_clock::now()),
+      mStopAfter(stopAfterCheckpoints()) {
+
+  // the input may be gone when it was deleted after it was split
+  bool haveInput = fs::exists(inputFile);
+  if (haveInput) {
+    mInputSize = fs::file_size(inputFile);
+    mInputTime = fs::last_write_time(inputFile).time_since_epoch().count();
+  }
+
+  rapidjson::Document d;
+  if (readJson(stateFile(), d) && d.HasMember("inputSize") &&
+      d.HasMember("inputTime") && d.HasMember("finished") &&
+      d.HasMember("options") && mOptions == d["options"].GetString()) {
+
+    bool sameInput = d["inputSize"].GetUint64() == mInputSize &&
+                     d["inputTime"].GetInt64() == mInputTime;
+
+    if (sameInput || (!haveInput && d["finished"].GetBool())) {
+
+      mInputSize = d["inputSize"].GetUint64();
+      mInputTime = d["inputTime"].GetInt64();
+      mPlanned = d["planned"].GetBool();
+      mFinished = d["finished"].GetBool();
+      mWaysDone = d["waysDone"].GetUint64();
+      mInputOffset = d["inputOffset"].GetUint64();
+
+      for (auto &leaf : d["leaves"].GetObject()) {
+        LeafProgress &progress = mLeaves[leaf.name.GetString()];
+        progress.nodeSegments = leaf.value["nodeSegments"].GetUint64();
+        progress.waySegments = leaf.value["waySegments"].GetUint64();
+        progress.ways = leaf.value["ways"].GetUint64();
+        progress.sharedWays = leaf.value["sharedWays"].GetUint64();
+        progress.writeNanos = leaf.value["writeNanos"].GetUint64();
+      }
+      return;
+    }
+  }
+
+  // nothing here that this input can use
+  fs::remove_all(mDirectory);
+  fs::create_directories(mDirectory);
+}
+
+void Checkpoint::saveState() {
+
+  rapidjson::Document d;
+  rapidjson::Document::AllocatorType &a = d.GetAllocator();
+  d.SetObject();
+  d.AddMember("inputSize", mInputSize, a);
+  d.AddMember("inputTime", mInputTime, a);
+  d.AddMember("options", rapidjson::Value(mOptions, a), a);
+  d.AddMember("planned", mPlanned, a);
+  d.AddMember("finished", mFinished, a);
+  d.AddMember("waysDone", mWaysDone, a);
+  d.AddMember("inputOffset", mInputOffset, a);
+
+  rapidjson::Value leaves(rapidjson::kObjectType);
+  for (const auto &[name, progress] : mLeaves) {
+    rapidjson::Value leaf(rapidjson::kObjectType);
+    leaf.AddMember("nodeSegments", uint64_t(progress.nodeSegments), a);
+    leaf.AddMember("waySegments", uint64_t(progress.waySegments), a);
+    leaf.AddMember("ways", progress.ways, a);
+    leaf.AddMember("sharedWays", progress.sharedWays, a);
+    leaf.AddMember("writeNanos", progress.writeNanos, a);
+    leaves.AddMember(rapidjson::Value(name, a), leaf, a);
+  }
+  d.AddMember("leaves", leaves, a);
+
+  writeJson(stateFile(), d);
+
+  mLast = std::chrono::steady_clock::now();
+}
+
+void Checkpoint::savePlan(const OSMSplitConfigPtr &config,
+                          const NodeLocations &nodes,
+                          const WayBoxTable &wayBoxes) {
+
+  SortedFileIndex<osmium::Location>::write(
+      nodesFile(), nodes.positive.cbegin(), nodes.positive.cend());
+  SortedFileIndex<osmium::Location>::write(
+      negativeNodesFile(), nodes.negative.cbegin(), nodes.negative.cend());
+
+  {
+    std::ofstream out(wayBoxesFile(), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(wayBoxes.data()),
+              wayBoxes.size() * sizeof(osmium::Box));
+    if (!out) {
+      throw std::runtime_error("Failed to write " + wayBoxesFile().string());
+    }
+  }
+
+  rapidjson::Document d;
+  rapidjson::Document::AllocatorType &a = d.GetAllocator();
+  d.SetObject().AddMember("osmsplit", config->toJson(a), a);
+  writeJson(planFile(), d);
+
+  // only taken as planned once everything above is on disk
+  mPlanned = true;
+  saveState();
+}
+
+void Checkpoint::loadPlan(OSMSplitConfigPtr &config) const {
+
+  rapidjson::Document d;
+  if (!readJson(planFile(), d) || !d.HasMember("osmsplit")) {
+    throw std::runtime_error("Failed to read " + planFile().string());
+  }
+
+  // filled in place, a config file's tree holds on to its leaves
+  if (config) {
+    config->initFromJSON(d["osmsplit"]);
+  } else {
+    config = std::make_shared<OSMSplitConfig>(d["osmsplit"]);
+  }
+}
+
+void Checkpoint::loadIndex(NodeLocations &nodes,
+                           WayBoxTable &wayBoxes) const {
+
+  // the index files are saved sorted by id, so appending them in file order
+  // leaves the store sorted without sorting it again
+  auto load = [](const fs::path &file, NodeLocatorMap &part) {
+    SortedFileIndex<osmium::Location> index(file);
+    for (auto it = index.cbegin(); it != index.cend(); ++it) {
+      part.set(it->first, it->second);
+    }
+  };
+  load(nodesFile(), nodes.positive);
+  load(negativeNodesFile(), nodes.negative);
+
+  wayBoxes.resize(fs::file_size(wayBoxesFile()) / sizeof(osmium::Box));
+  std::ifstream in(wayBoxesFile(), std::ios::binary);
+  in.read(reinterpret_cast<char *>(wayBoxes.data()),
+          wayBoxes.size() * sizeof(osmium::Box));
+  if (!in) {
+    throw std::runtime_error("Failed to read " + wayBoxesFile().string());
+  }
+}
+
+bool Checkpoint::due() const {
+  return std::chrono::steady_clock::now() - mLast >= mInterval;
+}
+
+void Checkpoint::saveProgress(
+    uint64_t waysDone, uint64_t inputOffset,
+    const std::map<std::string, LeafProgress> &leaves) {
+  // nothing is flushed or closed, as when the process is killed. The next
+  // checkpoint is stopped in before it's recorded, so the leaves have been
+  // written past the last one, as when killed part way through one
+  if (mStopAfter > 0 && mSaves++ >= mStopAfter) {
+    std::cout << "Stopping after checkpoint " << mStopAfter << std::endl;
+    std::_Exit(2);
+  }
+
+  mWaysDone = waysDone;
+  mInputOffset = inputOffset;
+  mLeaves = leaves;
+  saveState();
+}
+
+Checkpoint::LeafProgress
+Checkpoint::leafProgress(const OSMSplitConfigPtr &leaf) const {
+  auto it = mLeaves.find(leaf->getFileName().string());
+  return it != mLeaves.end() ? it->second : LeafProgress();
+}
+
+fs::path Checkpoint::markerFile(const OSMSplitConfigPtr &leaf) const {
+  return mDirectory / (leaf->getFileName().string() + ".done");
+}
+
+bool Checkpoint::leafDone(const OSMSplitConfigPtr &leaf) const {
+
+  rapidjson::Document d;
+  if (!readJson(markerFile(leaf), d) || !d.HasMember("leaf")) {
+    return false;
+  }
+
+  OSMSplitConfig done(d["leaf"]);
+  leaf->setContentBox(done.getContentBox());
+  leaf->setStats(done.getStats());
+  return true;
+}
+
+void Checkpoint::markLeafDone(const OSMSplitConfigPtr &leaf,
+                              uint64_t inputOffset) {
+
+  rapidjson::Document d;
+  rapidjson::Document::AllocatorType &a = d.GetAllocator();
+  d.SetObject();
+  d.AddMember("inputOffset", inputOffset, a);
+  d.AddMember("leaf", leaf->toJson(a), a);
+  writeJson(markerFile(leaf), d);
+}
+
+void Checkpoint::finish(const OSMSplitConfigPtr &config) {
+
+  rapidjson::Document d;
+  rapidjson::Document::AllocatorType &a = d.GetAllocator();
+  d.SetObject().AddMember("osmsplit", config->toJson(a), a);
+  writeJson(planFile(), d);
+
+  mFinished = true;
+  mPlanned = false;
+  mLeaves.clear();
+  saveState();
+
+  for (auto &entry : fs::directory_iterator(mDirectory)) {
+    if (entry.path() != planFile() && entry.path() != stateFile()) {
+      fs::remove(entry.path());
+    }
+  }
+}
+
+} // namespace GeoUtils
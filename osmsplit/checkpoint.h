@@ -0,0 +1,97 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+
+#include "main.h"
+#include "osmsplitconfig.h"
+
+namespace fs = std::filesystem;
+
+namespace GeoUtils {
+
+// what a long split has got through, kept in a directory of its own next to
+// the output so a run that was killed can pick up where it was. Once the
+// histogram pass is done it holds the split plan with the node locations and
+// way boxes the writing pass needs. The writing pass adds the way it had
+// reached with the segments each leaf had written by then, and a marker for
+// each leaf once it's finished. When the split is done only the final plan
+// is kept, so the input is skipped next time. It all starts over when the
+// input's size or time changes, or the options that change what's written
+class Checkpoint {
+public:
+  // segments a leaf had written at the last checkpoint of the writing pass,
+  // with the counts for its stats
+  struct LeafProgress {
+    size_t nodeSegments = 0;
+    size_t waySegments = 0;
+    uint64_t ways = 0;
+    uint64_t sharedWays = 0;
+    uint64_t writeNanos = 0;
+  };
+
+  Checkpoint(const fs::path &directory, const fs::path &inputFile,
+             const SplitOptions &options);
+
+  bool hasPlan() const { return mPlanned; }
+  bool finished() const { return mFinished; }
+
+  // the store has to be sorted, boxes are by way position
+  void savePlan(const OSMSplitConfigPtr &config, const NodeLocations &nodes,
+                const WayBoxTable &wayBoxes);
+
+  // fills in the config's splits, or makes it when there isn't one
+  void loadPlan(OSMSplitConfigPtr &config) const;
+  void loadIndex(NodeLocations &nodes, WayBoxTable &wayBoxes) const;
+
+  // whether the interval has passed since the last checkpoint
+  bool due() const;
+
+  void saveProgress(uint64_t waysDone, uint64_t inputOffset,
+                    const std::map<std::string, LeafProgress> &leaves);
+  uint64_t waysDone() const { return mWaysDone; }
+  uint64_t inputOffset() const { return mInputOffset; }
+  LeafProgress leafProgress(const OSMSplitConfigPtr &leaf) const;
+
+  // markers keep the leaf's content box and stats, which are put back in
+  // the config when it's found
+  bool leafDone(const OSMSplitConfigPtr &leaf) const;
+  void markLeafDone(const OSMSplitConfigPtr &leaf, uint64_t inputOffset);
+
+  // keeps only the plan, with the leaves' content boxes
+  void finish(const OSMSplitConfigPtr &config);
+
+protected:
+  void saveState();
+  fs::path planFile() const { return mDirectory / "plan.json"; }
+  fs::path nodesFile() const { return mDirectory / "nodes.idx"; }
+  fs::path negativeNodesFile() const {
+    return mDirectory / "negative_nodes.idx";
+  }
+  fs::path wayBoxesFile() const { return mDirectory / "wayboxes.bin"; }
+  fs::path stateFile() const { return mDirectory / "state.json"; }
+  fs::path markerFile(const OSMSplitConfigPtr &leaf) const;
+
+  fs::path mDirectory;
+  uint64_t mInputSize = 0;
+  int64_t mInputTime = 0;
+  std::string mOptions;
+  std::chrono::seconds mInterval;
+  std::chrono::steady_clock::time_point mLast;
+  int mStopAfter = 0;
+  int mSaves = 0;
+
+  bool mPlanned = false;
+  bool mFinished = false;
+  uint64_t mWaysDone = 0;
+  uint64_t mInputOffset = 0;
+  std::map<std::string, LeafProgress> mLeaves;
+};
+
+} // namespace GeoUtils
+
+#endif
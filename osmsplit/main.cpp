@@ -1,6 +1,7 @@
 
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
+#include <osmium/thread/pool.hpp>
 #include <osmium/util/memory.hpp>
 #include <osmium/visitor.hpp>
 
@@ -12,16 +13,26 @@
 
 #include "args.hxx"
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
 #include <iostream>
+#include <list>
+#include <map>
 #include <mutex>
 #include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 
+#include "changeapplier.h"
+#include "checkpoint.h"
 #include "main.h"
+#include "mappedsplittree.h"
 #include "mapsplit.h"
 #include "osmsplitconfig.h"
 #include "osmsplitwriter.h"
+#include "splitindex.h"
 
 using std::cerr;
 using std::cout;
@@ -44,9 +55,66 @@ namespace fs = std::filesystem;
 using IdSet = set<osmium::unsigned_object_id_type>;
 
 std::clock_t startTime;
-uint64_t numLocs = 0;
+std::atomic<uint64_t> numLocs{0};
 
 const std::string configFileExt = "_conf.json";
+const std::string treeFileExt = "_conf.idx";
+
+// peak memory of splitting a file, per byte of pbf input. Each node's id and
+// location take 16 bytes in the index, once more while the shards are merged,
+// and pbf packs a node into roughly 8 bytes
+const double memPerInputByte = 4.0;
+
+// a leaf's output is about the size of its input, staging more is wasted
+const double stagingPerInputByte = 2.0;
+
+// hands out memory and threads to leaves processed side by side. A leaf waits
+// until its estimated peak memory fits in what's left of the budget and a
+// thread is free, unless nothing else is running. Its share of the threads
+// follows its share of the budget
+class MemoryScheduler {
+public:
+  MemoryScheduler(uint64_t budget, int threads)
+      : mBudget(std::max<uint64_t>(1, budget)), mThreads(std::max(1, threads)),
+        mFreeThreads(mThreads) {}
+
+  // blocks until the leaf can run, returns the threads it gets
+  int acquire(uint64_t bytes) {
+
+    std::unique_lock<mutex> lock(mMutex);
+
+    mCondition.wait(lock, [&]() {
+      return mRunning == 0 || (mUsed + bytes <= mBudget && mFreeThreads > 0);
+    });
+
+    int threads = std::ceil(double(mThreads) * bytes / mBudget);
+    threads = std::clamp(threads, 1, mFreeThreads);
+
+    mUsed += bytes;
+    mFreeThreads -= threads;
+    mRunning++;
+    return threads;
+  }
+
+  void release(uint64_t bytes, int threads) {
+    {
+      std::lock_guard<mutex> g(mMutex);
+      mUsed -= bytes;
+      mFreeThreads += threads;
+      mRunning--;
+    }
+    mCondition.notify_all();
+  }
+
+protected:
+  uint64_t mBudget;
+  int mThreads;
+  int mFreeThreads;
+  uint64_t mUsed = 0;
+  int mRunning = 0;
+  mutex mMutex;
+  std::condition_variable mCondition;
+};
 
 int getMemUse() {
   osmium::MemoryUsage mem;
@@ -64,15 +132,100 @@ void printMemTimeUpdate() {
        << "elapsed " << getElapsedTime() << " mem : " << getMemUse() << endl;
 }
 
+bool parseCostWeights(const string &arg, SplitCostModel &model) {
+
+  vector<double> weights;
+  std::stringstream ss(arg);
+  string item;
+  try {
+    while (std::getline(ss, item, ',')) {
+      weights.push_back(std::stod(item));
+    }
+  } catch (const std::exception &) {
+    return false;
+  }
+  if (weights.size() != 4) {
+    return false;
+  }
+  model.nodeWeight = weights[0];
+  model.wayWeight = weights[1];
+  model.byteWeight = weights[2];
+  model.duplicateWeight = weights[3];
+  return true;
+}
+
+// the mapped index written beside a _conf.json
+fs::path treeFileFor(const fs::path &configFileName) {
+  auto name = configFileName.string();
+  return name.substr(0, name.size() - configFileExt.size()) + treeFileExt;
+}
+
 void writeConfigFile(const fs::path &configFileName, OSMSplitConfigPtr config) {
 
-  ofstream ofs(configFileName);
-  rapidjson::OStreamWrapper osw(ofs);
-  rapidjson::PrettyWriter<rapidjson::OStreamWrapper> writer(osw);
-  rapidjson::Document configDoc;
-  rapidjson::Document::AllocatorType &a = configDoc.GetAllocator();
-  configDoc.SetObject().AddMember("osmsplit", config->toJson(a), a);
-  configDoc.Accept(writer);
+  {
+    ofstream ofs(configFileName);
+    rapidjson::OStreamWrapper osw(ofs);
+    rapidjson::PrettyWriter<rapidjson::OStreamWrapper> writer(osw);
+    rapidjson::Document configDoc;
+    rapidjson::Document::AllocatorType &a = configDoc.GetAllocator();
+    configDoc.SetObject().AddMember("osmsplit", config->toJson(a), a);
+    configDoc.Accept(writer);
+  }
+
+  // the mapped index beside it, for the queries, stamped with the json it
+  // was written from
+  if (configFileName.string().ends_with(configFileExt)) {
+    GeoUtils::MappedSplitTree::write(treeFileFor(configFileName), config,
+                                     configFileName);
+  }
+}
+
+// the histogram pass, which leaves the split planned in the config and the
+// store and way boxes filled for writing the leaves
+void planSplit(osmium::io::Reader &reader, const fs::path &outDir,
+               OSMSplitConfigPtr &config, NodeLocations &nodeLocatorStore,
+               WayBoxTable &wayBoxes, const SplitOptions &options) {
+
+  GeoUtils::QuadHistogram::Options histogramOptions;
+  histogramOptions.maxDepth = options.histogramPrecision;
+
+  GeoUtils::SampleOptions sampling;
+  sampling.rate = options.sampleRate;
+  sampling.budget = options.sampleBudget;
+
+  MapHandler mapHandler(config, sampling, nodeLocatorStore,
+                        histogramOptions, options.costModel,
+                        options.planOnly);
+
+  GeoUtils::readHistogram(reader, mapHandler, nodeLocatorStore,
+                          options.threadNum);
+
+  cout << "Read Locations" << endl;
+  printMemTimeUpdate();
+  cout << "nodes " << nodeLocatorStore.size() << endl << endl;
+
+  numLocs = nodeLocatorStore.size();
+
+  fs::path pngFile =
+      outDir / config->getFileName().replace_extension(".split.png");
+
+  cout << "Writing out " << pngFile << std::endl;
+
+  mapHandler.finish(pngFile, options.depthLevels);
+
+  printMemTimeUpdate();
+
+  if (options.planOnly) {
+    fs::path planFile =
+        outDir / config->getFileName().replace_extension(".plan.csv");
+
+    cout << "Writing plan " << planFile << endl;
+
+    mapHandler.writePlan(planFile);
+    return;
+  }
+
+  wayBoxes = mapHandler.takeWayBoxes();
 }
 
 void processOSMFile(const fs::path &inputFileName, const fs::path &outDir,
@@ -99,6 +252,21 @@ void processOSMFile(const fs::path &inputFileName, const fs::path &outDir,
     }
   }
 
+  // kept until the split is done, a run that was killed picks up from it
+  std::unique_ptr<GeoUtils::Checkpoint> checkpoint;
+  if (options.checkpointSeconds >= 0) {
+    auto checkpointDir = outDir / (outFileNamePrefix.string() + ".checkpoint");
+    checkpoint = std::make_unique<GeoUtils::Checkpoint>(checkpointDir,
+                                                        inputFileName, options);
+
+    if (checkpoint->finished()) {
+      cout << "Already split " << inputFileName << ", see " << checkpointDir
+           << endl;
+      checkpoint->loadPlan(config);
+      return;
+    }
+  }
+
   osmium::io::File inputOsFile{inputFileName.string()};
   osmium::io::Reader reader{inputOsFile, osmium::osm_entity_bits::node |
                                              osmium::osm_entity_bits::way};
@@ -109,60 +277,291 @@ void processOSMFile(const fs::path &inputFileName, const fs::path &outDir,
                                               outFileNamePrefix.string());
   }
 
-  NodeLocatorMap nodeLocatorStore;
+  NodeLocations nodeLocatorStore;
 
   if (!reader.header().box()) {
     cout << "No extents in header" << endl;
     return;
   }
-  MapHandler<uint32_t, 1024> mapHandler(config, options.sampleRate,
-                                        nodeLocatorStore);
 
-  osmium::apply(reader, mapHandler);
+  WayBoxTable wayBoxes;
 
-  cout << "Read Locations" << endl;
-  printMemTimeUpdate();
-  cout << "nodes " << nodeLocatorStore.size() << endl << endl;
-
-  numLocs = nodeLocatorStore.size();
-
-  fs::path pngFile =
-      outDir / config->getFileName().replace_extension(".split.png");
+  if (checkpoint && checkpoint->hasPlan()) {
 
-  cout << "Writing out " << pngFile << std::endl;
+    reader.close();
+    cout << "Resuming from the plan checkpointed for " << inputFileName
+         << endl;
 
-  mapHandler.finish(pngFile, options.depthLevels);
+    checkpoint->loadPlan(config);
+    checkpoint->loadIndex(nodeLocatorStore, wayBoxes);
+    numLocs = nodeLocatorStore.size();
+  } else {
+    planSplit(reader, outDir, config, nodeLocatorStore, wayBoxes, options);
 
-  printMemTimeUpdate();
+    if (options.planOnly) {
+      return;
+    }
+    if (checkpoint) {
+      checkpoint->savePlan(config, nodeLocatorStore, wayBoxes);
+    }
+  }
 
   OSMSplitWriter osm_writer(config, inputFileName, outDir, nodeLocatorStore,
-                            options.threadNum, mapHandler.numWays());
+                            std::move(wayBoxes), options, checkpoint.get());
+
+  if (checkpoint) {
+    checkpoint->finish(config);
+  }
 }
-void processConfigFile(const fs::path &inputFileName, const fs::path &outDir,
-                       OSMSplitConfigPtr &config, SplitOptions options) {
-  auto inputDir = std::filesystem::path(inputFileName).parent_path();
+
+OSMSplitConfigPtr readConfigFile(const fs::path &configFileName) {
 
   std::stringstream ss;
-  std::ifstream file(inputFileName);
+  std::ifstream file(configFileName);
   ss << file.rdbuf();
   file.close();
   rapidjson::Document d;
 
   if (!d.Parse<0>(ss.str().c_str()).HasParseError() &&
       d.HasMember("osmsplit")) {
-    config = std::make_shared<OSMSplitConfig>(d["osmsplit"]);
+    return std::make_shared<OSMSplitConfig>(d["osmsplit"]);
+  }
+  return nullptr;
+}
 
-    OSMConfigList configList = config->getLeafNodes();
-    for (auto leaf : configList) {
+// the mapped index of the split whose _conf.json is given, written again
+// from the json when it's missing, from another version or the json has
+// changed since. Empty when the json can't be parsed
+fs::path currentTreeFile(const fs::path &configFileName) {
 
-      auto inputFilePath = inputDir / leaf->getFileName();
+  fs::path treeFile = treeFileFor(configFileName);
 
-      processOSMFile(inputFilePath, outDir, leaf, options);
+  if (!GeoUtils::MappedSplitTree::current(treeFile, configFileName)) {
+    auto config = readConfigFile(configFileName);
+    if (config == nullptr) {
+      cout << "Failed to parse config file '" << configFileName << "'" << endl;
+      return fs::path();
+    }
+    GeoUtils::MappedSplitTree::write(treeFile, config, configFileName);
+  }
+  return treeFile;
+}
 
-      if (options.deleteInputFiles) {
-        fs::remove(inputFilePath);
+// updates the leaves of an earlier split in place from a change file, using
+// the index kept with --keep-index. The changes are routed with the mapped
+// index, the config is only read to save the rewritten leaves' new content
+// boxes and stats to
+int applyChanges(const fs::path &configFileName, const fs::path &changeFile) {
+
+  auto name = configFileName.string();
+  fs::path indexPrefix = name.substr(0, name.size() - configFileExt.size());
+
+  if (!GeoUtils::SplitIndex::exists(indexPrefix)) {
+    cout << "No index at " << indexPrefix
+         << ", split with --keep-index to update with changes" << endl;
+    return 1;
+  }
+
+  fs::path treeFile = currentTreeFile(configFileName);
+  if (treeFile.empty()) {
+    return 1;
+  }
+
+  GeoUtils::SplitIndex index(indexPrefix);
+  std::map<GeoUtils::ChangeApplier::LeafId, GeoUtils::ChangeApplier::LeafUpdate>
+      updates;
+  {
+    GeoUtils::MappedSplitTree tree(treeFile);
+    GeoUtils::ChangeApplier applier(tree, configFileName.parent_path(), index);
+
+    size_t rewritten = applier.apply(changeFile);
+    cout << "Leaves rewritten : " << rewritten << endl;
+
+    updates = applier.updates();
+  }
+
+  if (updates.empty()) {
+    return 0;
+  }
+
+  // numbered as the mapped index's leaves are, it was written from this json
+  auto config = readConfigFile(configFileName);
+  if (config == nullptr) {
+    cout << "Failed to parse config file '" << configFileName << "'" << endl;
+    return 1;
+  }
+  GeoUtils::OSMSplitTree tree(config);
+  for (const auto &[leaf, update] : updates) {
+    tree.leaves()[leaf]->setContentBox(update.contentBox);
+    tree.leaves()[leaf]->setStats(update.stats);
+  }
+
+  writeConfigFile(configFileName, config);
+  return 0;
+}
+
+// lon,lat pairs separated by commas
+bool parseLocations(const string &arg, vector<osmium::Location> &result) {
+
+  vector<double> coords;
+  std::stringstream ss(arg);
+  string item;
+  try {
+    while (std::getline(ss, item, ',')) {
+      coords.push_back(std::stod(item));
+    }
+  } catch (const std::exception &) {
+    return false;
+  }
+  if (coords.empty() || coords.size() % 2) {
+    return false;
+  }
+  result.clear();
+  for (size_t i = 0; i < coords.size(); i += 2) {
+    result.emplace_back(coords[i], coords[i + 1]);
+  }
+  return true;
+}
+
+// prints the leaves touching each box and then each polygon, from the mapped
+// index of the split whose _conf.json is given. A line for each leaf, with an
+// empty line between the queries
+int queryLeaves(const fs::path &configFileName, const vector<string> &boxArgs,
+                const vector<string> &polygonArgs) {
+
+  vector<osmium::Box> boxes;
+  for (const auto &arg : boxArgs) {
+    vector<osmium::Location> corners;
+    if (!parseLocations(arg, corners) || corners.size() != 2) {
+      cout << "Expected minLon,minLat,maxLon,maxLat, got '" << arg << "'"
+           << endl;
+      return 1;
+    }
+    osmium::Box box;
+    box.extend(corners[0]);
+    box.extend(corners[1]);
+    boxes.push_back(box);
+  }
+
+  vector<GeoUtils::MappedSplitTree::Ring> rings;
+  for (const auto &arg : polygonArgs) {
+    GeoUtils::MappedSplitTree::Ring ring;
+    if (!parseLocations(arg, ring) || ring.size() < 3) {
+      cout << "Expected lon,lat of 3 or more points, got '" << arg << "'"
+           << endl;
+      return 1;
+    }
+    rings.push_back(std::move(ring));
+  }
+
+  fs::path treeFile = currentTreeFile(configFileName);
+  if (treeFile.empty()) {
+    return 1;
+  }
+
+  GeoUtils::MappedSplitTree tree(treeFile);
+
+  vector<GeoUtils::MappedSplitTree::LeafId> leaves;
+  vector<size_t> offsets;
+  bool first = true;
+
+  auto print = [&]() {
+    for (size_t query = 0; query + 1 < offsets.size(); query++) {
+      if (!first) {
+        cout << endl;
+      }
+      first = false;
+      for (size_t i = offsets[query]; i < offsets[query + 1]; i++) {
+        cout << tree.leafFileName(leaves[i]) << endl;
       }
     }
+  };
+
+  tree.leavesForBoxes(boxes, leaves, offsets);
+  print();
+  tree.leavesForPolygons(rings, leaves, offsets);
+  print();
+
+  return 0;
+}
+
+void processConfigFile(const fs::path &inputFileName, const fs::path &outDir,
+                       OSMSplitConfigPtr &config, SplitOptions options) {
+  auto inputDir = std::filesystem::path(inputFileName).parent_path();
+
+  config = readConfigFile(inputFileName);
+
+  if (config) {
+
+    struct LeafJob {
+      OSMSplitConfigPtr leaf;
+      fs::path inputFile;
+      uint64_t stagingBytes;
+      uint64_t peakBytes;
+    };
+    vector<LeafJob> jobs;
+
+    for (auto leaf : config->getLeafNodes()) {
+
+      auto inputFilePath = inputDir / leaf->getFileName();
+
+      if (!fs::exists(inputFilePath)) {
+        cout << "Missing leaf input " << inputFilePath << endl;
+        continue;
+      }
+      double inputBytes = fs::file_size(inputFilePath);
+
+      LeafJob job{leaf, inputFilePath};
+      job.stagingBytes =
+          std::min<uint64_t>(uint64_t(options.stagingMemMB) * 1024 * 1024,
+                             inputBytes * stagingPerInputByte);
+      job.peakBytes = inputBytes * memPerInputByte + job.stagingBytes;
+      jobs.push_back(job);
+    }
+
+    // biggest first, so the small leaves fill in around them at the end
+    std::sort(jobs.begin(), jobs.end(), [](const auto &a, const auto &b) {
+      return a.peakBytes > b.peakBytes;
+    });
+
+    MemoryScheduler scheduler(uint64_t(options.memoryBudgetMB) * 1024 * 1024,
+                              options.threadNum);
+
+    std::list<thread> threads;
+    for (auto &job : jobs) {
+
+      int leafThreads = scheduler.acquire(job.peakBytes);
+
+      SplitOptions leafOptions = options;
+      leafOptions.threadNum = leafThreads;
+      leafOptions.stagingMemMB =
+          std::max<uint64_t>(1, job.stagingBytes / (1024 * 1024));
+
+      cout << tfm::format("Starting %s on %d threads, estimated peak %d MB",
+                          job.inputFile.string(), leafThreads,
+                          job.peakBytes / (1024 * 1024))
+           << endl;
+
+      threads.push_back(thread([&scheduler, &outDir, job, leafOptions,
+                                leafThreads]() {
+        OSMSplitConfigPtr leaf = job.leaf;
+        try {
+          processOSMFile(job.inputFile, outDir, leaf, leafOptions);
+
+          if (leafOptions.deleteInputFiles) {
+            fs::remove(job.inputFile);
+          }
+        } catch (const std::exception &ex) {
+          cout << "Exception " << ex.what() << " splitting " << job.inputFile
+               << endl;
+        }
+        scheduler.release(job.peakBytes, leafThreads);
+      }));
+    }
+
+    for (auto &t : threads) {
+      t.join();
+    }
   } else {
     cout << "Faliled to parse config file '" << inputFileName << "'" << endl;
 
@@ -185,12 +584,95 @@ int main(int argi, char **argc) {
                                             "Specify output directory", {'o'});
   args::ValueFlag<int> levelsArg(parser, "1", "Specify number of splits wanted",
                                  {'l'});
-  args::ValueFlag<int> sampleRateArg(parser, "s", "Sample Rate", {'s'});
+  args::ValueFlag<int> sampleRateArg(
+      parser, "s", "Sample Rate, 1 in s nodes go into the histogram", {'s'});
+  args::ValueFlag<uint64_t> sampleBudgetArg(
+      parser, "samples",
+      "Most node samples to take, the sample rate drops as it's reached",
+      {"samples"});
   args::ValueFlag<int> maxThreadsArg(parser, "t", "Max Threads", {'t'});
+  args::ValueFlag<int> stagingMemArg(
+      parser, "m", "Memory in MB for staging leaf output before spilling",
+      {'m'});
+  args::ValueFlag<int> memoryBudgetArg(
+      parser, "M",
+      "Memory in MB for leaves of a config file split side by side", {'M'});
+  args::ValueFlag<int> openWritersArg(
+      parser, "f", "Max leaf segment writers open at once", {'f'});
+  args::ValueFlag<int> encodeThreadsArg(
+      parser, "threads",
+      "Threads encoding and compressing the output, shared by all leaves, "
+      "defaults to one per core",
+      {"encode-threads"});
+  args::ValueFlag<int> compressionArg(
+      parser, "level",
+      "Compression level of the output blobs, 0 for none, higher is smaller "
+      "and slower",
+      {"compression"});
+  args::ValueFlag<int> blobEntitiesArg(
+      parser, "entities",
+      "Entities a leaf gathers before spilling, so its blobs are filled",
+      {"blob-entities"});
+  args::ValueFlag<int> precisionArg(
+      parser, "p", "Histogram precision, the max depth dense areas refine to",
+      {'p'});
+  args::ValueFlag<std::string> costWeightsArg(
+      parser, "nodes,ways,bytes,duplicates",
+      "Split cost weights for nodes, ways, estimated bytes and ways "
+      "duplicated across split lines",
+      {'w'});
   args::Flag updateOnlyArg(
       parser, "u", "Don't redo existing output files if input file is older",
       {'u'});
   args::Flag deleteInputFilesArg(parser, "d", "Delete input files", {'d'});
+  args::Flag joinArg(parser, "j",
+                     "Look up each way buffer's node locations in one sorted "
+                     "sweep of the index, faster on large extracts",
+                     {'j'});
+  args::Flag clipArg(parser, "c",
+                     "Clip open ways crossing leaves to the nodes each leaf "
+                     "needs, plus one past its boundary",
+                     {'c'});
+  args::Flag locationsOnWaysArg(
+      parser, "locations-on-ways",
+      "Write leaves with node locations on the ways and no separate nodes, "
+      "so readers don't need a location index. Leaves written this way "
+      "can't be split further",
+      {"locations-on-ways"});
+  args::Flag keepIndexArg(parser, "keep-index",
+                          "Keep the node location and way box index next to "
+                          "the leaves, for --apply-changes",
+                          {"keep-index"});
+  args::ValueFlag<int> checkpointArg(
+      parser, "minutes",
+      "Checkpoint the split every so many minutes, a rerun after the process "
+      "is killed resumes from the last checkpoint and skips finished inputs",
+      {"checkpoint"});
+  args::ValueFlag<int> checkpointSecondsArg(
+      parser, "seconds",
+      "Checkpoint every so many seconds instead, 0 for after every buffer of "
+      "ways read",
+      {"checkpoint-seconds"});
+  args::ValueFlag<std::string> applyChangesArg(
+      parser, "changes.osc",
+      "Update the leaves of the split whose _conf.json is given with -i "
+      "from a change file",
+      {"apply-changes"});
+  args::ValueFlagList<std::string> queryArg(
+      parser, "minLon,minLat,maxLon,maxLat",
+      "Print the leaves touching a box, of the split whose _conf.json is "
+      "given with -i. Repeat for more boxes, the leaves of each query follow "
+      "an empty line",
+      {"query"});
+  args::ValueFlagList<std::string> queryPolygonArg(
+      parser, "lon,lat,lon,lat,...",
+      "Print the leaves touching a polygon, after those of the boxes. "
+      "Repeat for more polygons",
+      {"query-polygon"});
+  args::Flag planArg(parser, "plan",
+                     "Only run the histogram pass and write the split plan "
+                     "with the predicted size of each leaf",
+                     {"plan"});
 
   // couldn't get splitwriter to work with normal osm files
   // args::Flag                    outputXMLFormat(parser, "x", "Output to xml
@@ -210,6 +692,30 @@ int main(int argi, char **argc) {
     std::cerr << parser;
     return 1;
   }
+  if ((applyChangesArg || queryArg || queryPolygonArg) &&
+      (!inputFileArg || !args::get(inputFileArg).ends_with(configFileExt))) {
+    cout << "--apply-changes and the queries take the " << configFileExt
+         << " of a split with -i" << endl;
+    return 1;
+  }
+  if (applyChangesArg) {
+    try {
+      return applyChanges(args::get(inputFileArg), args::get(applyChangesArg));
+    } catch (const std::exception &ex) {
+      cout << "Exception " << ex.what() << endl;
+      return 1;
+    }
+  }
+  if (queryArg || queryPolygonArg) {
+    try {
+      return queryLeaves(args::get(inputFileArg), args::get(queryArg),
+                         args::get(queryPolygonArg));
+    } catch (const std::exception &ex) {
+      cout << "Exception " << ex.what() << endl;
+      return 1;
+    }
+  }
+
   if (!inputFileArg || !outputDirArg || !levelsArg) {
 
     cout << parser;
@@ -221,6 +727,9 @@ int main(int argi, char **argc) {
   if (sampleRateArg) {
     options.sampleRate = args::get(sampleRateArg);
   }
+  if (sampleBudgetArg) {
+    options.sampleBudget = args::get(sampleBudgetArg);
+  }
   if (levelsArg) {
     options.depthLevels = args::get(levelsArg);
   }
@@ -229,6 +738,41 @@ int main(int argi, char **argc) {
     options.threadNum = args::get(maxThreadsArg);
   }
 
+  if (stagingMemArg) {
+    options.stagingMemMB = args::get(stagingMemArg);
+  }
+
+  if (memoryBudgetArg) {
+    options.memoryBudgetMB = args::get(memoryBudgetArg);
+  }
+
+  if (openWritersArg) {
+    options.maxOpenWriters = args::get(openWritersArg);
+  }
+
+  if (encodeThreadsArg) {
+    options.encodeThreads = args::get(encodeThreadsArg);
+  }
+
+  if (compressionArg) {
+    options.compressionLevel = args::get(compressionArg);
+  }
+
+  if (blobEntitiesArg) {
+    options.blobEntities = args::get(blobEntitiesArg);
+  }
+
+  if (precisionArg) {
+    options.histogramPrecision = args::get(precisionArg);
+  }
+
+  if (costWeightsArg) {
+    if (!parseCostWeights(args::get(costWeightsArg), options.costModel)) {
+      cerr << "Cost weights must be 4 comma separated numbers" << endl;
+      return 1;
+    }
+  }
+
   if (deleteInputFilesArg) {
     options.deleteInputFiles = args::get(deleteInputFilesArg);
   }
@@ -237,10 +781,46 @@ int main(int argi, char **argc) {
     options.updateOnly = args::get(updateOnlyArg);
   }
 
+  if (joinArg) {
+    options.joinLocations = true;
+  }
+
+  if (clipArg) {
+    options.clipWays = true;
+  }
+
+  if (locationsOnWaysArg) {
+    options.locationsOnWays = true;
+  }
+
+  if (keepIndexArg) {
+    options.keepIndex = true;
+  }
+
+  if (checkpointArg) {
+    options.checkpointSeconds = args::get(checkpointArg) * 60;
+  }
+
+  if (checkpointSecondsArg) {
+    options.checkpointSeconds = args::get(checkpointSecondsArg);
+  }
+
+  if (planArg) {
+    options.planOnly = true;
+    options.deleteInputFiles = false;
+  }
+
   // if(outputXMLFormat) {
   //   OSMSplitConfig::setOutputSuffix(".osm");
   // }
 
+  // one pool for every leaf, including those of a config file split side by
+  // side, so compression keeps the cores busy without oversubscribing them
+  osmium::thread::Pool encodePool(
+      options.encodeThreads > 0 ? options.encodeThreads
+                                : int(std::thread::hardware_concurrency()));
+  options.encodePool = &encodePool;
+
   try {
 
     auto outDir = args::get(outputDirArg);
@@ -250,47 +830,26 @@ int main(int argi, char **argc) {
 
     fs::path configFileName;
 
-    int remainingDepthLevels = options.depthLevels;
-
-    while (remainingDepthLevels) {
+    // the whole split tree is planned from one histogram pass and every
+    // leaf is written from one read of the input, whatever the depth
+    if (inputFileName.filename().string().ends_with(configFileExt)) {
 
-      if (remainingDepthLevels > 8) {
-        remainingDepthLevels -= 8;
-        options.depthLevels = 8;
-      } else {
-        options.depthLevels = remainingDepthLevels;
-        remainingDepthLevels = 0;
-      }
-      if (inputFileName.extension() == configFileExt) {
-
-        processConfigFile(inputFileName, outDir, config, options);
+      processConfigFile(inputFileName, outDir, config, options);
 
-        configFileName =
-            outDir / std::filesystem::path(inputFileName).filename();
+      configFileName = outDir / std::filesystem::path(inputFileName).filename();
 
-        writeConfigFile(configFileName, config);
+      writeConfigFile(configFileName, config);
+    } else {
 
-        if (remainingDepthLevels) {
-          inputFileName = configFileName;
-          options.deleteInputFiles = true;
-        }
-      } else {
+      processOSMFile(inputFileName, outDir, config, options);
 
-        processOSMFile(inputFileName, outDir, config, options);
+      configFileName =
+          outDir / inputFileName.filename().replace_extension(configFileExt);
 
-        configFileName =
-            outDir / inputFileName.filename().replace_extension(configFileExt);
+      writeConfigFile(configFileName, config);
 
-        writeConfigFile(configFileName, config);
-
-        if (options.deleteInputFiles) {
-          fs::remove(inputFileName);
-        }
-
-        if (remainingDepthLevels) {
-          inputFileName = configFileName;
-          options.deleteInputFiles = true;
-        }
+      if (options.deleteInputFiles) {
+        fs::remove(inputFileName);
       }
     }
   } catch (std::bad_alloc &) {
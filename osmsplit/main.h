@@ -11,15 +11,57 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <filesystem>
 
 namespace fs = std::filesystem;
 
+namespace osmium::thread {
+class Pool;
+}
+
 using NodeLocatorMap =
     osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type,
                                        osmium::Location>;
 
+// node locations by id. Negative ids, as editors like JOSM give new nodes,
+// are kept in a store of their own so they don't collide with positive ones
+struct NodeLocations {
+  NodeLocatorMap positive;
+  NodeLocatorMap negative;
+
+  void set(osmium::object_id_type id, const osmium::Location &loc) {
+    if (id >= 0) {
+      positive.set(osmium::unsigned_object_id_type(id), loc);
+    } else {
+      negative.set(osmium::unsigned_object_id_type(-id), loc);
+    }
+  }
+
+  // both stores need to be sorted
+  osmium::Location get_noexcept(osmium::object_id_type id) const {
+    return id >= 0
+               ? positive.get_noexcept(osmium::unsigned_object_id_type(id))
+               : negative.get_noexcept(osmium::unsigned_object_id_type(-id));
+  }
+
+  void sort() {
+    positive.sort();
+    negative.sort();
+  }
+
+  void clear() {
+    positive.clear();
+    negative.clear();
+  }
+
+  size_t size() const { return positive.size() + negative.size(); }
+};
+
+// bounding box of every way in the input, by its position among the ways
+using WayBoxTable = std::vector<osmium::Box>;
+
 std::string constructOutDirName(const std::string &inputFileArg,
                                 const std::string &outputDirArg);
 std::string fileNameFromPath(const std::string &path);
@@ -51,11 +93,44 @@ protected:
   std::mutex mMutex;
 };
 
+// weights for what a leaf costs, the split planner keeps the dearer side of
+// each split as cheap as it can. Nodes only gives the plain median split
+struct SplitCostModel {
+  double nodeWeight = 1;
+  double wayWeight = 0;
+  double byteWeight = 0;
+  double duplicateWeight = 0;
+
+  bool nodesOnly() const {
+    return wayWeight == 0 && byteWeight == 0 && duplicateWeight == 0;
+  }
+};
+
 struct SplitOptions {
   int depthLevels = 1;
   int sampleRate = 1;
+  uint64_t sampleBudget = 0;
   int threadNum = 1;
+  int stagingMemMB = 2048;
+  int maxOpenWriters = 64;
+  int memoryBudgetMB = 8192;
+  int histogramPrecision = 20;
+  // below zero doesn't checkpoint, zero checkpoints after every buffer of
+  // ways read
+  int checkpointSeconds = -1;
+  // below zero leaves libosmium's default, zero stores blobs uncompressed
+  int compressionLevel = -1;
+  int blobEntities = 8000;
+  int encodeThreads = 0;
+  // encodes the output of every leaf, osmium's default pool when not set
+  osmium::thread::Pool *encodePool = nullptr;
+  SplitCostModel costModel;
   bool updateOnly = false;
+  bool planOnly = false;
+  bool joinLocations = false;
+  bool clipWays = false;
+  bool locationsOnWays = false;
+  bool keepIndex = false;
   bool deleteInputFiles = false;
 };
 
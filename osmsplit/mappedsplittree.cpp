@@ -0,0 +1,259 @@
+#include "mappedsplittree.h"
+#include "boxgeometry.h"
+
+#include <osmium/io/detail/read_write.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+namespace GeoUtils {
+
+const char splitTreeMagic[8] = {'o', 's', 'm', 's', 'p', 'l', 'i', 't'};
+const uint32_t splitTreeVersion = 2;
+
+// even-odd rule, the ring doesn't need to repeat its first location
+static bool pointInRing(const MappedSplitTree::Ring &ring,
+                        const osmium::Location &p) {
+
+  bool inside = false;
+  for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++) {
+    const auto &a = ring[i];
+    const auto &b = ring[j];
+    if ((a.y() > p.y()) != (b.y() > p.y())) {
+      double x = a.x() + (double(p.y()) - a.y()) * (double(b.x()) - a.x()) /
+                             (double(b.y()) - a.y());
+      if (p.x() < x) {
+        inside = !inside;
+      }
+    }
+  }
+  return inside;
+}
+
+// an edge passing through the box, or the box inside the ring
+static bool ringTouchesBox(const MappedSplitTree::Ring &ring,
+                           const osmium::Box &box) {
+
+  if (ring.size() == 1) {
+    return box.contains(ring[0]);
+  }
+  for (size_t i = 0; i < ring.size(); i++) {
+    if (segmentInBox(ring[i], ring[(i + 1) % ring.size()], box)) {
+      return true;
+    }
+  }
+  return pointInRing(ring, box.bottom_left());
+}
+
+static int64_t fileTime(const fs::path &file) {
+  return fs::last_write_time(file).time_since_epoch().count();
+}
+
+void MappedSplitTree::write(const fs::path &file,
+                            const OSMSplitConfigPtr &root,
+                            const fs::path &configFile) {
+
+  OSMSplitTree tree(root);
+
+  std::vector<Leaf> leaves;
+  std::string names;
+
+  for (const auto &config : tree.leaves()) {
+    auto name = config->getFileName().string();
+    const auto &stats = config->getStats();
+
+    Leaf leaf{};
+    leaf.box = config->getBox();
+    leaf.contentBox = config->getContentBox();
+    leaf.nameOffset = names.size();
+    leaf.nameLength = name.size();
+    leaf.bytes = stats.bytes;
+    leaf.nodes = stats.nodes;
+    leaf.ways = stats.ways;
+    leaf.sharedWays = stats.sharedWays;
+    leaf.writeSeconds = stats.writeSeconds;
+    leaves.push_back(leaf);
+
+    names += name;
+  }
+
+  Header header{};
+  std::memcpy(header.magic, splitTreeMagic, sizeof(header.magic));
+  header.version = splitTreeVersion;
+  header.numNodes = tree.nodes().size();
+  header.numLeaves = leaves.size();
+  header.stringPoolBytes = names.size();
+  header.extents = tree.extents();
+  header.configBytes = fs::file_size(configFile);
+  header.configTime = fileTime(configFile);
+
+  // written beside the file and moved over it, so readers never map a part
+  // written one
+  fs::path tmp = file.string() + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+    out.write(reinterpret_cast<const char *>(tree.nodes().data()),
+              tree.nodes().size() * sizeof(SplitTreeNode));
+    out.write(reinterpret_cast<const char *>(tree.contentNodes().data()),
+              tree.contentNodes().size() * sizeof(SplitTreeNode));
+    out.write(reinterpret_cast<const char *>(leaves.data()),
+              leaves.size() * sizeof(Leaf));
+    out.write(names.data(), names.size());
+    if (!out) {
+      throw std::runtime_error("Failed to write split tree " + tmp.string());
+    }
+  }
+  fs::rename(tmp, file);
+}
+
+bool MappedSplitTree::current(const fs::path &file,
+                              const fs::path &configFile) {
+
+  Header header{};
+  std::ifstream in(file, std::ios::binary);
+  in.read(reinterpret_cast<char *>(&header), sizeof(Header));
+
+  return in &&
+         !std::memcmp(header.magic, splitTreeMagic, sizeof(splitTreeMagic)) &&
+         header.version == splitTreeVersion &&
+         header.configBytes == fs::file_size(configFile) &&
+         header.configTime == fileTime(configFile);
+}
+
+MappedSplitTree::MappedSplitTree(const fs::path &file) {
+
+  size_t size = fs::file_size(file);
+  if (size < sizeof(Header)) {
+    throw std::runtime_error("Not a split tree " + file.string());
+  }
+
+  mFd = osmium::io::detail::open_for_reading(file.string());
+  mMapping = std::make_unique<osmium::util::MemoryMapping>(
+      size, osmium::util::MemoryMapping::mapping_mode::readonly, mFd, 0);
+
+  const char *data = mMapping->get_addr<char>();
+  mHeader = reinterpret_cast<const Header *>(data);
+
+  size_t expected = sizeof(Header) +
+                    2 * size_t(mHeader->numNodes) * sizeof(SplitTreeNode) +
+                    size_t(mHeader->numLeaves) * sizeof(Leaf) +
+                    mHeader->stringPoolBytes;
+
+  if (std::memcmp(mHeader->magic, splitTreeMagic, sizeof(splitTreeMagic)) ||
+      mHeader->version != splitTreeVersion || mHeader->numNodes == 0 ||
+      size != expected) {
+    mMapping.reset();
+    osmium::io::detail::reliable_close(mFd);
+    throw std::runtime_error("Not a split tree " + file.string());
+  }
+
+  mNodes = reinterpret_cast<const SplitTreeNode *>(data + sizeof(Header));
+  mContentNodes = mNodes + mHeader->numNodes;
+  mLeaves = reinterpret_cast<const Leaf *>(mContentNodes + mHeader->numNodes);
+  mNames = reinterpret_cast<const char *>(mLeaves + mHeader->numLeaves);
+}
+
+MappedSplitTree::~MappedSplitTree() {
+  mMapping.reset();
+  if (mFd >= 0) {
+    osmium::io::detail::reliable_close(mFd);
+  }
+}
+
+std::string_view MappedSplitTree::leafFileName(LeafId leaf) const {
+  return std::string_view(mNames + mLeaves[leaf].nameOffset,
+                          mLeaves[leaf].nameLength);
+}
+
+LeafStats MappedSplitTree::leafStats(LeafId leaf) const {
+  const Leaf &entry = mLeaves[leaf];
+  LeafStats stats;
+  stats.bytes = entry.bytes;
+  stats.nodes = entry.nodes;
+  stats.ways = entry.ways;
+  stats.sharedWays = entry.sharedWays;
+  stats.writeSeconds = entry.writeSeconds;
+  return stats;
+}
+
+void MappedSplitTree::addLeavesForBox(const osmium::Box &box,
+                                      std::vector<LeafId> &result) const {
+  if (boxesOverlap(box, mHeader->extents)) {
+    GeoUtils::leavesForBox(mNodes, 0, box, result);
+  }
+}
+
+// the leaves the ring's box touches, less those the ring itself misses
+void MappedSplitTree::addLeavesForPolygon(const Ring &ring,
+                                          std::vector<LeafId> &result) const {
+
+  osmium::Box box;
+  for (const auto &loc : ring) {
+    box.extend(loc);
+  }
+
+  size_t first = result.size();
+  addLeavesForBox(box, result);
+
+  auto end = std::remove_if(
+      result.begin() + first, result.end(),
+      [&](LeafId leaf) { return !ringTouchesBox(ring, mLeaves[leaf].box); });
+  result.erase(end, result.end());
+}
+
+void MappedSplitTree::leavesForBox(const osmium::Box &box,
+                                   std::vector<LeafId> &result) const {
+  result.clear();
+  addLeavesForBox(box, result);
+}
+
+void MappedSplitTree::leavesForPolygon(const Ring &ring,
+                                       std::vector<LeafId> &result) const {
+  result.clear();
+  addLeavesForPolygon(ring, result);
+}
+
+void MappedSplitTree::leavesForLocation(const osmium::Location &loc,
+                                        std::vector<LeafId> &result) const {
+  result.clear();
+
+  if (!loc.valid()) {
+    return;
+  }
+  GeoUtils::leavesForBox(mContentNodes, 0, osmium::Box(loc, loc), result);
+
+  // the descent only tests one axis at each split
+  auto end = std::remove_if(result.begin(), result.end(), [&](LeafId leaf) {
+    const osmium::Box &box = mLeaves[leaf].contentBox;
+    return !box.valid() || !box.contains(loc);
+  });
+  result.erase(end, result.end());
+}
+
+void MappedSplitTree::leavesForBoxes(const std::vector<osmium::Box> &boxes,
+                                     std::vector<LeafId> &result,
+                                     std::vector<size_t> &offsets) const {
+  result.clear();
+  offsets.assign(1, 0);
+  for (const auto &box : boxes) {
+    addLeavesForBox(box, result);
+    offsets.push_back(result.size());
+  }
+}
+
+void MappedSplitTree::leavesForPolygons(const std::vector<Ring> &rings,
+                                        std::vector<LeafId> &result,
+                                        std::vector<size_t> &offsets) const {
+  result.clear();
+  offsets.assign(1, 0);
+  for (const auto &ring : rings) {
+    addLeavesForPolygon(ring, result);
+    offsets.push_back(result.size());
+  }
+}
+
+} // namespace GeoUtils
@@ -0,0 +1,114 @@
+#ifndef MAPPED_SPLIT_TREE_H
+#define MAPPED_SPLIT_TREE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include "osmsplitconfig.h"
+
+namespace fs = std::filesystem;
+
+namespace GeoUtils {
+
+// the split config compiled to a flat file that's mapped read only and
+// queried as it is, with no parsing or tree of configs to build. It holds a
+// header, the split tree's nodes, the content tree's nodes, a table of leaves
+// and a pool of their file names. Written next to each _conf.json, which
+// stays the format to edit and exchange, and out of date once that changes
+class MappedSplitTree {
+public:
+  using LeafId = OSMSplitTree::LeafId;
+  using Ring = std::vector<osmium::Location>;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t numNodes;
+    uint32_t numLeaves;
+    uint32_t reserved;
+    uint64_t stringPoolBytes;
+    osmium::Box extents;
+    // size and time of the _conf.json written from
+    uint64_t configBytes;
+    int64_t configTime;
+  };
+
+  struct Leaf {
+    osmium::Box box;
+    osmium::Box contentBox;
+    uint64_t nameOffset;
+    uint64_t nameLength;
+    uint64_t bytes;
+    uint64_t nodes;
+    uint64_t ways;
+    uint64_t sharedWays;
+    double writeSeconds;
+  };
+
+  explicit MappedSplitTree(const fs::path &file);
+  ~MappedSplitTree();
+
+  MappedSplitTree(const MappedSplitTree &) = delete;
+  MappedSplitTree &operator=(const MappedSplitTree &) = delete;
+
+  // the config has to be written to the _conf.json first
+  static void write(const fs::path &file, const OSMSplitConfigPtr &root,
+                    const fs::path &configFile);
+
+  // whether the file is there, in this version and written from the
+  // _conf.json as it is now
+  static bool current(const fs::path &file, const fs::path &configFile);
+
+  size_t numLeaves() const { return mHeader->numLeaves; }
+  const osmium::Box &extents() const { return mHeader->extents; }
+  std::string_view leafFileName(LeafId leaf) const;
+  const osmium::Box &leafBox(LeafId leaf) const { return mLeaves[leaf].box; }
+  const osmium::Box &leafContentBox(LeafId leaf) const {
+    return mLeaves[leaf].contentBox;
+  }
+  LeafStats leafStats(LeafId leaf) const;
+
+  // clear the result and fill it with the leaves touched
+  void leavesForBox(const osmium::Box &box, std::vector<LeafId> &result) const;
+  void leavesForPolygon(const Ring &ring, std::vector<LeafId> &result) const;
+
+  // clear the result and fill it with the leaves whose content box holds the
+  // location
+  void leavesForLocation(const osmium::Location &loc,
+                         std::vector<LeafId> &result) const;
+
+  // the leaves of every query in one list, those of query i run from
+  // offsets[i] to offsets[i + 1]
+  void leavesForBoxes(const std::vector<osmium::Box> &boxes,
+                      std::vector<LeafId> &result,
+                      std::vector<size_t> &offsets) const;
+  void leavesForPolygons(const std::vector<Ring> &rings,
+                         std::vector<LeafId> &result,
+                         std::vector<size_t> &offsets) const;
+
+protected:
+  // appends rather than clearing, for the batches
+  void addLeavesForBox(const osmium::Box &box,
+                       std::vector<LeafId> &result) const;
+  void addLeavesForPolygon(const Ring &ring,
+                           std::vector<LeafId> &result) const;
+
+  int mFd = -1;
+  std::unique_ptr<osmium::util::MemoryMapping> mMapping;
+  const Header *mHeader = nullptr;
+  const SplitTreeNode *mNodes = nullptr;
+  const SplitTreeNode *mContentNodes = nullptr;
+  const Leaf *mLeaves = nullptr;
+  const char *mNames = nullptr;
+};
+
+} // namespace GeoUtils
+
+#endif
@@ -1,149 +1,280 @@
 #ifndef MAPHANDLER_H
 #define MAPHANDLER_H
 
+#include <algorithm>
 #include <assert.h>
+#include <cmath>
+#include <fstream>
+#include <limits>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
 #include <osmium/handler.hpp>
+#include <thread>
 #include <vector>
 
-#include <osmium/handler/node_locations_for_ways.hpp>
-#include <osmium/index/node_locations_map.hpp>
+#include <osmium/geom/util.hpp>
+#include <osmium/io/reader.hpp>
+#include <osmium/thread/queue.hpp>
 
 #include "main.h"
 #include "osmsplitconfig.h"
 #include "png++/png.hpp"
-
-using location_handler_type =
-    osmium::handler::NodeLocationsForWays<NodeLocatorMap>;
+#include "quadhistogram.h"
 
 namespace GeoUtils {
 
-template <typename T, unsigned int D> struct MapSplit {
-public:
-  struct Rect;
-  using PairRect = std::pair<Rect, Rect>;
+// size of the heatmap image written alongside the split
+const uint32_t mapImageSize = 1024;
 
-  struct Rect {
-    T x, y, xlen, ylen;
+// rough encoded pbf sizes used to estimate leaf output sizes
+const double nodeEncodedBytes = 6.0;
+const double wayRefEncodedBytes = 2.5;
+const double tagCompression = 0.5;
 
-    PairRect split(int midPoint, bool lon) {
+// bounding box and estimated encoded size of a sampled way
+struct WaySample {
+  QuadHistogram::Rect box;
+  double bytes;
 
-      PairRect result = PairRect(*this, *this);
+  bool intersects(const QuadHistogram::Rect &rect) const {
+    return box.x0 < rect.x1 && box.x1 > rect.x0 && box.y0 < rect.y1 &&
+           box.y1 > rect.y0;
+  }
+  bool within(const QuadHistogram::Rect &rect) const {
+    return box.x0 >= rect.x0 && box.x1 <= rect.x1 && box.y0 >= rect.y0 &&
+           box.y1 <= rect.y1;
+  }
+};
 
-      if (lon) {
-        result.first.xlen = midPoint;
-        result.second.x = this->x + midPoint;
-        result.second.xlen = xlen - midPoint;
-      } else {
-        result.first.ylen = midPoint;
-        result.second.y = this->y + midPoint;
-        result.second.ylen = ylen - midPoint;
-      }
-      return result;
-    }
-  };
+using WaySampleList = std::vector<const WaySample *>;
 
-  MapSplit() : mMaxCell(0) { mData = std::vector<T>(D * D, 0); }
+// estimated contents of a leaf, scaled up from the samples
+struct LeafEstimate {
+  double nodes = 0;
+  double ways = 0;
+  double bytes = 0;
+  double duplicates = 0;
 
-  void incr(uint32_t x, uint32_t y) {
+  double cost(const SplitCostModel &model) const {
+    return model.nodeWeight * nodes + model.wayWeight * ways +
+           model.byteWeight * bytes + model.duplicateWeight * duplicates;
+  }
+};
 
-    T &v = index(x, y);
-    v++;
+// how nodes are sampled into the histogram. Each node is picked by a hash of
+// its id with a chance of 1 in rate, so the picks don't line up with runs of
+// ids from imports. With a budget, the chance halves each time the samples
+// taken outgrow it and later samples count for more to make up for it
+struct SampleOptions {
+  uint32_t rate = 1;
+  uint64_t budget = 0;
+};
 
-    if (v > mMaxCell) {
-      mMaxCell = v;
-    }
+// spreads ids evenly over 64 bits (splitmix64 finaliser)
+inline uint64_t mixId(uint64_t id) {
+  id += 0x9e3779b97f4a7c15ULL;
+  id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  id = (id ^ (id >> 27)) * 0x94d049bb133111ebULL;
+  return id ^ (id >> 31);
+}
+
+// 95% bound on how far a median taken from this many samples can be off, as a
+// fraction of the nodes being split
+inline double medianErrorBound(double samples) {
+  return samples > 0 ? 1.96 * 0.5 / std::sqrt(samples) : 1.0;
+}
+
+// first pass over the input, stores node locations and samples them into the
+// histogram the split is planned from
+class MapHandler : public osmium::handler::Handler {
+public:
+  using Rect = QuadHistogram::Rect;
+
+  // ways are sampled when the cost model needs them or when sampleWays is set
+  // to get per leaf predictions
+  MapHandler(OSMSplitConfigPtr config, SampleOptions sampling,
+             NodeLocations &store, QuadHistogram::Options histogramOptions,
+             SplitCostModel costModel, bool sampleWays = false)
+      : mSampling(sampling), mSampleLevel(0), mNodeSamples(0),
+        mNextLevelAt(sampling.budget), mNodeCount(0), mWayCount(0),
+        mStore(&store), mConfig(config),
+        mMap(config->getBox(), histogramOptions), mCostModel(costModel),
+        mSampleWays(sampleWays || !costModel.nodesOnly()) {
+    mSampling.rate = std::max<uint32_t>(1, mSampling.rate);
+    mSampleThreshold = std::numeric_limits<uint64_t>::max() / mSampling.rate;
   }
 
-  T &index(uint32_t x, uint32_t y) {
+  // handler with the same settings for a worker thread, storing locations in
+  // its own shard of the index. The sample budget is shared between shards
+  std::unique_ptr<MapHandler> shard(NodeLocations &store,
+                                    int numShards) const {
+    SampleOptions sampling = mSampling;
+    sampling.budget = (sampling.budget + numShards - 1) / numShards;
+    return std::make_unique<MapHandler>(mConfig, sampling, store,
+                                        mMap.options(), mCostModel,
+                                        mSampleWays);
+  }
 
-    assert(x < D && y < D);
+  // takes on the counts and samples of a shard, the shard's locations are
+  // merged separately as the index has to be complete before the ways
+  void merge(MapHandler &other) {
+    mMap.merge(other.mMap);
+    mNodeSamples += other.mNodeSamples;
+    mNodeCount += other.mNodeCount;
+    mWayCount += other.mWayCount;
+    mWaySamples.insert(mWaySamples.end(), other.mWaySamples.begin(),
+                       other.mWaySamples.end());
+    std::move(other.mWayBoxes.begin(), other.mWayBoxes.end(),
+              std::back_inserter(mWayBoxes));
+    other.mWayBoxes.clear();
+  }
 
-    return mData[x + (y * D)];
+  // the following ways start at this position in the input, each run of
+  // ways gets its boxes recorded separately as they're spread over threads
+  void startWays(uint64_t firstWay) {
+    mWayBoxes.push_back({firstWay, WayBoxTable()});
   }
 
-  PairRect split(Rect rect, bool lon, uint32_t &midPoint) {
+  void useStore(NodeLocations &store) { mStore = &store; }
 
-    std::vector<T> list(lon ? rect.xlen : rect.ylen);
+  void node(const osmium::Node &node) {
+
+    const osmium::Location &loc = node.location();
+
+    mStore->set(node.id(), loc);
+
+    mNodeCount++;
 
-    int total = 0;
-    for (uint32_t ypos = rect.y; ypos < rect.y + rect.ylen; ypos++) {
-      for (uint32_t xpos = rect.x; xpos < rect.x + rect.xlen; xpos++) {
+    if (loc.valid() &&
+        mixId(node.positive_id()) <= (mSampleThreshold >> mSampleLevel)) {
 
-        T &v = index(xpos, ypos);
-        total += v;
-        auto pos = lon ? (xpos - rect.x) : (ypos - rect.y);
-        assert(pos < list.size());
-        list[pos] += v;
+      // each sample stands in for the nodes that weren't picked
+      mMap.incr(loc, uint64_t(mSampling.rate) << mSampleLevel);
+      mNodeSamples++;
+
+      if (mSampling.budget && mNodeSamples >= mNextLevelAt &&
+          mSampleLevel < 32) {
+        mSampleLevel++;
+        mNextLevelAt += std::max<uint64_t>(1, mSampling.budget >> mSampleLevel);
       }
     }
-    midPoint = 0;
-    T count = list[midPoint];
-    while (count < total / 2) {
-      midPoint++;
-      assert(midPoint < list.size());
-      count += list[midPoint];
-    }
-    return rect.split(midPoint, lon);
   }
 
-  const T &max() { return mMaxCell; }
+  void way(const osmium::Way &way) {
 
-protected:
-  uint32_t mMaxCell;
-  std::vector<T> mData;
-};
+    osmium::Box box;
+    for (const auto &node : way.nodes()) {
+      box.extend(mStore->get_noexcept(node.ref()));
+    }
 
-using DblPair = std::tuple<double, double>;
+    if (mWayBoxes.empty()) {
+      startWays(mWayCount);
+    }
+    mWayBoxes.back().second.push_back(box);
 
-template <typename T, unsigned int D>
-class MapHandler : public location_handler_type {
-public:
-  MapHandler(OSMSplitConfigPtr config, uint32_t sampleRate,
-             NodeLocatorMap &store)
-      : location_handler_type(store), mSampleRate(sampleRate), mWayCount(0),
-        mConfig(config) {
-    const osmium::Box &extents = mConfig->getBox();
+    mWayCount++;
 
-    mLocMin = DblPair(extents.bottom_left().lon(), extents.bottom_left().lat());
+    if (!mSampleWays) {
+      return;
+    }
 
-    mLocIncr = DblPair(
-        (extents.top_right().lon() - extents.bottom_left().lon()) / (D),
-        (extents.top_right().lat() - extents.bottom_left().lat()) / (D));
-  }
+    if (mixId(way.positive_id()) <= mSampleThreshold) {
 
-  void node(const osmium::Node &node) {
+      if (box.valid()) {
+        WaySample sample;
+        sample.box = {box.bottom_left().x(), box.bottom_left().y(),
+                      int64_t(box.top_right().x()) + 1,
+                      int64_t(box.top_right().y()) + 1};
+        sample.bytes = way.nodes().size() * wayRefEncodedBytes +
+                       way.tags().byte_size() * tagCompression;
+        mWaySamples.push_back(sample);
+      }
+    }
+  }
 
-    location_handler_type::node(node);
+  // estimated nodes, ways, bytes and ways crossing out of the rect, given the
+  // sampled ways that touch it
+  LeafEstimate estimate(const Rect &rect, const WaySampleList &samples) const {
 
-    if (mSampleCount++ >= mSampleRate) {
+    LeafEstimate result;
 
-      const osmium::Location &loc = node.location();
+    double nodeScale = mMap.total() ? double(mNodeCount) / mMap.total() : 0;
+    double wayScale =
+        mWaySamples.size() ? double(mWayCount) / mWaySamples.size() : 0;
 
-      int x = (loc.lon() - std::get<0>(mLocMin)) / std::get<0>(mLocIncr);
-      int y = (loc.lat() - std::get<1>(mLocMin)) / std::get<1>(mLocIncr);
+    result.nodes = mMap.count(rect) * nodeScale;
+    result.bytes = result.nodes * nodeEncodedBytes;
 
-      if (x > 0 && x < D && y > 0 && y < D) {
-        mMap.incr(x, y);
+    for (auto sample : samples) {
+      if (sample->intersects(rect)) {
+        result.ways += wayScale;
+        result.bytes += sample->bytes * wayScale;
+        if (!sample->within(rect)) {
+          result.duplicates += wayScale;
+        }
       }
-
-      mSampleCount = 0;
     }
+    return result;
   }
 
-  void way(osmium::Way &way) {
-    location_handler_type::way(way);
+  // position along the axis that keeps the dearer of the two halves as cheap
+  // as possible. The lower half only gets dearer and the upper half cheaper
+  // as the position moves up, so the crossing point is found by bisection
+  int64_t costSplit(const Rect &rect, bool lon, const WaySampleList &samples) {
 
-    mWayCount++;
+    auto halfCosts = [&](int64_t pos) {
+      auto halves = rect.split(pos, lon);
+      return std::make_pair(estimate(halves.first, samples).cost(mCostModel),
+                            estimate(halves.second, samples).cost(mCostModel));
+    };
+
+    int64_t lo = (lon ? rect.x0 : rect.y0) + 1;
+    int64_t hi = (lon ? rect.x1 : rect.y1) - 1;
+
+    if (hi <= lo) {
+      return lo;
+    }
+
+    while (hi - lo > 1) {
+      int64_t mid = lo + (hi - lo) / 2;
+      auto costs = halfCosts(mid);
+      if (costs.first < costs.second) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+
+    auto loCosts = halfCosts(lo);
+    auto hiCosts = halfCosts(hi);
+    return std::max(loCosts.first, loCosts.second) <=
+                   std::max(hiCosts.first, hiCosts.second)
+               ? lo
+               : hi;
   }
 
   void printMap() {
 
-    mImage = png::image<png::rgb_pixel>(D, D);
+    mImage = png::image<png::rgb_pixel>(mapImageSize, mapImageSize);
+
+    std::vector<double> densities(mapImageSize * mapImageSize);
+    double maxDensity = 0;
 
-    for (png::uint_32 y = 0; y < mImage.get_height(); ++y) {
-      for (png::uint_32 x = 0; x < mImage.get_width(); ++x) {
-        T v = 255 * mMap.index(x, y) / mMap.max();
+    for (png::uint_32 y = 0; y < mapImageSize; ++y) {
+      for (png::uint_32 x = 0; x < mapImageSize; ++x) {
+        double d = mMap.density(imageToMap(x, true), imageToMap(y, false));
+        densities[x + y * mapImageSize] = d;
+        maxDensity = std::max(maxDensity, d);
+      }
+    }
+
+    for (png::uint_32 y = 0; y < mapImageSize; ++y) {
+      for (png::uint_32 x = 0; x < mapImageSize; ++x) {
+        uint8_t v = maxDensity > 0
+                        ? 255 * densities[x + y * mapImageSize] / maxDensity
+                        : 0;
         mImage.set_pixel(x, y, png::rgb_pixel(v, v, v));
       }
     }
@@ -151,82 +282,382 @@ public:
 
   void finish(const fs::path &imageName, uint32_t levels) {
 
+    std::cout << "Histogram cells " << mMap.numCells() << std::endl;
+
+    // the last splits only see the samples that fell in their part of the map
+    double lastLevelSamples =
+        levels > 0 ? mNodeSamples / std::pow(2.0, levels - 1) : mNodeSamples;
+    std::cout << tfm::format("Sampled %d of %d nodes, median error bound "
+                             "(95%%) first split %.2f%%, last split %.2f%%",
+                             mNodeSamples, mNodeCount,
+                             100 * medianErrorBound(mNodeSamples),
+                             100 * medianErrorBound(lastLevelSamples))
+              << std::endl;
+
     printMap();
 
-    typename MapSplit<T, D>::Rect rect = {0, 0, D, D};
+    WaySampleList samples;
+    samples.reserve(mWaySamples.size());
+    for (auto &sample : mWaySamples) {
+      samples.push_back(&sample);
+    }
 
-    split(levels, rect, mConfig);
+    split(levels, mMap.bounds(), mConfig, samples);
 
     mImage.write(imageName.string());
   }
 
-  void printSplit(uint32_t start, uint32_t len, uint32_t midPoint, bool lon) {
+  // pixel to fixed point coordinate and back along one axis
+  int64_t imageToMap(uint32_t pixel, bool lon) {
+    const Rect &b = mMap.bounds();
+    return lon ? b.x0 + (b.width() * (2 * pixel + 1)) / (2 * mapImageSize)
+               : b.y0 + (b.height() * (2 * pixel + 1)) / (2 * mapImageSize);
+  }
+
+  uint32_t mapToImage(int64_t pos, bool lon) {
+    const Rect &b = mMap.bounds();
+    int64_t pixel = lon ? ((pos - b.x0) * mapImageSize) / b.width()
+                        : ((pos - b.y0) * mapImageSize) / b.height();
+    return std::clamp<int64_t>(pixel, 0, mapImageSize - 1);
+  }
+
+  void printSplit(const Rect &rect, int64_t midPoint, bool lon) {
 
-    for (uint32_t i = start; i < len + start; i++) {
+    uint32_t line = mapToImage(midPoint, lon);
+    uint32_t start = mapToImage(lon ? rect.y0 : rect.x0, !lon);
+    uint32_t end = mapToImage((lon ? rect.y1 : rect.x1) - 1, !lon);
 
-      mImage.set_pixel(lon ? midPoint : i, lon ? i : midPoint,
+    for (uint32_t i = start; i <= end; i++) {
+
+      mImage.set_pixel(lon ? line : i, lon ? i : line,
                        png::rgb_pixel(233, 34, 12));
     }
   }
 
-  double midPointReal(uint32_t midPoint, bool lon) {
+  double midPointReal(int64_t midPoint) {
+    return double(midPoint) / osmium::detail::coordinate_precision;
+  }
+
+  uint64_t numWays() { return mWayCount; }
 
-    double proportion = (double)midPoint / D;
-    osmium::Box extents = mConfig->getBox();
-    if (lon) {
+  // joins the recorded runs into one table in input order, so the writing
+  // pass can look up each way's box instead of its node locations
+  WayBoxTable takeWayBoxes() {
 
-      double width = extents.top_right().lon() - extents.bottom_left().lon();
-      return width * proportion + extents.bottom_left().lon();
-    } else {
+    std::sort(mWayBoxes.begin(), mWayBoxes.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
 
-      double height = extents.top_right().lat() - extents.bottom_left().lat();
-      return height * proportion + extents.bottom_left().lat();
+    WayBoxTable result;
+    result.reserve(mWayCount);
+    for (auto &run : mWayBoxes) {
+      assert(run.first == result.size());
+      result.insert(result.end(), run.second.begin(), run.second.end());
+      WayBoxTable().swap(run.second);
     }
+    mWayBoxes.clear();
+    return result;
   }
 
-  uint64_t numWays() { return mWayCount; }
-  void split(int levels, typename MapSplit<T, D>::Rect rect,
-             OSMSplitConfigPtr config) {
+  int64_t splitPoint(const Rect &rect, bool lon,
+                     const WaySampleList &samples) {
+    return mCostModel.nodesOnly() ? mMap.median(rect, lon)
+                                  : costSplit(rect, lon, samples);
+  }
+
+  // width over height in metres, or the other way up, so 1 is square
+  static double aspect(const Rect &rect) {
+    double midLat =
+        (rect.y0 + rect.y1) / 2.0 / osmium::detail::coordinate_precision;
+    double width = rect.width() * std::cos(osmium::geom::deg_to_rad(midLat));
+    double height = rect.height();
+    if (width <= 0 || height <= 0) {
+      return std::numeric_limits<double>::max();
+    }
+    return std::max(width / height, height / width);
+  }
+
+  // lower is better. When the cost model counts ways it's the number of
+  // sampled ones crossing the split line, as those get written to both sides,
+  // otherwise how far from square the less square half is. Ways sampled only
+  // for the estimates don't change the split
+  double axisScore(const Rect &rect, bool lon, int64_t midPoint,
+                   const WaySampleList &samples) {
+
+    auto halves = rect.split(midPoint, lon);
+
+    if (!mCostModel.nodesOnly() && samples.size()) {
+      double crossing = 0;
+      for (auto sample : samples) {
+        if (sample->intersects(halves.first) &&
+            sample->intersects(halves.second)) {
+          crossing++;
+        }
+      }
+      return crossing;
+    }
+    return std::max(aspect(halves.first), aspect(halves.second));
+  }
 
-    // for(int i=0; i<6-levels; i++) {
-    //   std::cout << "\t";
-    // }
-    // std::cout << "Rect " << rect.x << " " << rect.y << " " << rect.xlen << "
-    // " << rect.ylen << std::endl;
+  void split(int levels, const Rect &rect, OSMSplitConfigPtr config,
+             const WaySampleList &samples) {
+
+    if (levels == 0) {
+      mLeafEstimates.push_back({config, estimate(rect, samples)});
+    }
 
-    bool lat = config->sortByLat();
     if (levels--) {
 
-      uint32_t midPoint;
-      auto rectSplits = mMap.split(rect, !lat, midPoint);
+      // try both axes and keep the one with fewer ways crossing the split,
+      // or the squarer halves
+      int64_t lonMidPoint = splitPoint(rect, true, samples);
+      int64_t latMidPoint = splitPoint(rect, false, samples);
 
-      double midPointR;
-      if (lat) {
-        midPointR = midPointReal(midPoint + rect.y, !lat);
-        printSplit(rect.x, rect.xlen, midPoint + rect.y, !lat);
-      } else {
-        midPointR = midPointReal(midPoint + rect.x, !lat);
-        printSplit(rect.y, rect.ylen, midPoint + rect.x, !lat);
+      bool lat = axisScore(rect, false, latMidPoint, samples) <
+                 axisScore(rect, true, lonMidPoint, samples);
+      int64_t midPoint = lat ? latMidPoint : lonMidPoint;
+
+      auto rectSplits = rect.split(midPoint, !lat);
+
+      printSplit(rect, midPoint, !lat);
+
+      auto configPair = config->split(midPointReal(midPoint), lat);
+
+      WaySampleList firstSamples, secondSamples;
+      for (auto sample : samples) {
+        if (sample->intersects(rectSplits.first)) {
+          firstSamples.push_back(sample);
+        }
+        if (sample->intersects(rectSplits.second)) {
+          secondSamples.push_back(sample);
+        }
       }
-      auto configPair = config->split(midPointR);
 
-      split(levels, rectSplits.first, configPair.first);
-      split(levels, rectSplits.second, configPair.second);
+      split(levels, rectSplits.first, configPair.first, firstSamples);
+      split(levels, rectSplits.second, configPair.second, secondSamples);
     }
   }
 
+  // table of the predicted contents of each leaf, printed and written as csv
+  void writePlan(const fs::path &csvFile) {
+
+    std::ofstream csv(csvFile);
+    csv << "file,nodes,ways,duplicated_ways,bytes" << std::endl;
+
+    std::cout << tfm::format("%-30s %14s %12s %12s %14s", "leaf", "nodes",
+                             "ways", "duplicated", "bytes")
+              << std::endl;
+
+    LeafEstimate total;
+    for (auto &leaf : mLeafEstimates) {
+      const LeafEstimate &e = leaf.second;
+      auto fileName = leaf.first->getFileName().string();
+
+      std::cout << tfm::format("%-30s %14.0f %12.0f %12.0f %14.0f", fileName,
+                               e.nodes, e.ways, e.duplicates, e.bytes)
+                << std::endl;
+      csv << tfm::format("%s,%.0f,%.0f,%.0f,%.0f", fileName, e.nodes, e.ways,
+                         e.duplicates, e.bytes)
+          << std::endl;
+
+      total.nodes += e.nodes;
+      total.ways += e.ways;
+      total.duplicates += e.duplicates;
+      total.bytes += e.bytes;
+    }
+
+    std::cout << tfm::format("%-30s %14.0f %12.0f %12.0f %14.0f", "total",
+                             total.nodes, total.ways, total.duplicates,
+                             total.bytes)
+              << std::endl;
+  }
+
 protected:
-  DblPair mLocMin;
-  DblPair mLocIncr;
-  osmium::Box mExtents;
-  MapSplit<T, D> mMap;
-  uint32_t mSampleRate;
-  uint32_t mSampleCount;
+  SampleOptions mSampling;
+  uint64_t mSampleThreshold;
+  uint32_t mSampleLevel;
+  uint64_t mNodeSamples;
+  uint64_t mNextLevelAt;
+  uint64_t mNodeCount;
   uint64_t mWayCount;
+  NodeLocations *mStore;
   OSMSplitConfigPtr mConfig;
+  QuadHistogram mMap;
+  SplitCostModel mCostModel;
+  bool mSampleWays;
+  std::vector<WaySample> mWaySamples;
+  std::vector<std::pair<uint64_t, WayBoxTable>> mWayBoxes;
+  std::vector<std::pair<OSMSplitConfigPtr, LeafEstimate>> mLeafEstimates;
   png::image<png::rgb_pixel> mImage;
 };
 
+using SharedBuffer = std::shared_ptr<osmium::memory::Buffer>;
+
+// a buffer and the position among the input's ways of its first way
+using IndexedBuffer = std::pair<SharedBuffer, uint64_t>;
+using SharedBufferQueue = osmium::thread::Queue<IndexedBuffer>;
+
+// fills a part of the store, the positive or negative ids, with that part of
+// the location shards in id order. The shards are sorted side by side, then
+// moved over one at a time and freed, so only one shard is held twice while
+// moving. The sorted runs are then merged in place, pairs of neighbouring runs
+// side by side, instead of sorting the whole store again. Each merge takes a
+// buffer the size of its smaller run, so the last round can hold half the
+// store again, the peak is about one and a half times the index
+inline void mergeShards(std::vector<NodeLocations> &shards,
+                        NodeLocatorMap NodeLocations::*part,
+                        NodeLocatorMap &store) {
+
+  std::list<std::thread> threads;
+  for (auto &shard : shards) {
+    threads.push_back(
+        std::thread([&shard, part]() { (shard.*part).sort(); }));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  // where each run starts in the store, and where the last ends
+  std::vector<size_t> runs{store.size()};
+  for (auto &shard : shards) {
+    for (const auto &element : shard.*part) {
+      store.set(element.first, element.second);
+    }
+    (shard.*part).clear();
+    runs.push_back(store.size());
+  }
+
+  while (runs.size() > 2) {
+
+    threads.clear();
+    std::vector<size_t> merged{runs.front()};
+
+    for (size_t i = 0; i + 2 < runs.size(); i += 2) {
+      auto first = store.begin() + runs[i];
+      auto middle = store.begin() + runs[i + 1];
+      auto last = store.begin() + runs[i + 2];
+      threads.push_back(std::thread([first, middle, last]() {
+        std::inplace_merge(first, middle, last);
+      }));
+      merged.push_back(runs[i + 2]);
+    }
+    // an odd run out waits for the next round
+    if (runs.size() % 2 == 0) {
+      merged.push_back(runs.back());
+    }
+
+    for (auto &t : threads) {
+      t.join();
+    }
+    runs.swap(merged);
+  }
+}
+
+inline void mergeShards(std::vector<NodeLocations> &shards,
+                        NodeLocations &store) {
+  mergeShards(shards, &NodeLocations::positive, store.positive);
+  mergeShards(shards, &NodeLocations::negative, store.negative);
+}
+
+// runs the first pass on a number of threads. Each worker fills its own
+// histogram and location shard from the node buffers, the shards are merged
+// into the store when the first way turns up, as the input has its nodes
+// before its ways, then the workers box, count and sample the ways against it
+inline void readHistogram(osmium::io::Reader &reader, MapHandler &mapHandler,
+                          NodeLocations &store, int numThreads) {
+
+  numThreads = std::max(1, numThreads);
+
+  std::vector<NodeLocations> shardStores(numThreads);
+  std::vector<std::unique_ptr<MapHandler>> shards;
+  for (auto &shardStore : shardStores) {
+    shards.push_back(mapHandler.shard(shardStore, numThreads));
+  }
+
+  auto runWorkers = [&](bool nodes, SharedBufferQueue &queue) {
+    std::list<std::thread> threads;
+    for (auto &shard : shards) {
+      threads.push_back(std::thread([&queue, &shard, nodes]() {
+        while (true) {
+          IndexedBuffer indexed;
+          queue.wait_and_pop(indexed);
+          auto &buffer = indexed.first;
+          if (!buffer) {
+            break;
+          }
+          if (nodes) {
+            for (const auto &node : buffer->select<osmium::Node>()) {
+              shard->node(node);
+            }
+          } else {
+            shard->startWays(indexed.second);
+            for (const auto &way : buffer->select<osmium::Way>()) {
+              shard->way(way);
+            }
+          }
+        }
+      }));
+    }
+    return threads;
+  };
+
+  auto stopWorkers = [&](SharedBufferQueue &queue,
+                         std::list<std::thread> &threads) {
+    for (int i = 0; i < numThreads; i++) {
+      queue.push({nullptr, 0});
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+  };
+
+  SharedBufferQueue nodeQueue(numThreads * 4, "osmsplit_nodes");
+  auto nodeThreads = runWorkers(true, nodeQueue);
+
+  SharedBuffer firstWays;
+  while (osmium::memory::Buffer read = reader.read()) {
+
+    auto buffer = std::make_shared<osmium::memory::Buffer>(std::move(read));
+    nodeQueue.push({buffer, 0});
+
+    auto ways = buffer->select<osmium::Way>();
+    if (ways.begin() != ways.end()) {
+      firstWays = buffer;
+      break;
+    }
+  }
+
+  stopWorkers(nodeQueue, nodeThreads);
+
+  mergeShards(shardStores, store);
+
+  SharedBufferQueue wayQueue(numThreads * 4, "osmsplit_ways");
+  for (auto &shard : shards) {
+    shard->useStore(store);
+  }
+  auto wayThreads = runWorkers(false, wayQueue);
+
+  uint64_t nextWay = 0;
+  auto pushWays = [&](SharedBuffer buffer) {
+    auto ways = buffer->select<osmium::Way>();
+    wayQueue.push({buffer, nextWay});
+    nextWay += std::distance(ways.begin(), ways.end());
+  };
+
+  if (firstWays) {
+    pushWays(firstWays);
+    while (osmium::memory::Buffer read = reader.read()) {
+      pushWays(std::make_shared<osmium::memory::Buffer>(std::move(read)));
+    }
+  }
+  reader.close();
+
+  stopWorkers(wayQueue, wayThreads);
+
+  for (auto &shard : shards) {
+    mapHandler.merge(*shard);
+  }
+}
+
 } // namespace GeoUtils
 
 #endif
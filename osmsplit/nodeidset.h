@@ -0,0 +1,65 @@
+#ifndef NODE_ID_SET_H
+#define NODE_ID_SET_H
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include <osmium/osm/types.hpp>
+
+namespace GeoUtils {
+
+// set of node ids stored as a bitmap split into small chunks, chunks are only
+// allocated for the parts of the id space a leaf actually uses
+class NodeIdSet {
+
+  static const uint32_t chunkBits = 15;
+  static const uint64_t idsPerChunk = uint64_t(1) << chunkBits;
+  static const uint64_t wordsPerChunk = idsPerChunk / 64;
+
+public:
+  // returns true if the id wasn't in the set already
+  bool checkAndSet(osmium::unsigned_object_id_type id) {
+
+    uint64_t chunkIndex = id >> chunkBits;
+
+    if (mLastChunk == nullptr || chunkIndex != mLastChunkIndex) {
+      auto &chunk = mChunks[chunkIndex];
+      if (!chunk) {
+        chunk = std::make_unique<uint64_t[]>(wordsPerChunk);
+      }
+      mLastChunk = chunk.get();
+      mLastChunkIndex = chunkIndex;
+    }
+
+    uint64_t offset = id & (idsPerChunk - 1);
+    uint64_t &word = mLastChunk[offset / 64];
+    uint64_t bit = uint64_t(1) << (offset % 64);
+
+    if (word & bit) {
+      return false;
+    }
+    word |= bit;
+    mSize++;
+    return true;
+  }
+
+  uint64_t size() const { return mSize; }
+  uint64_t bytes() const { return mChunks.size() * wordsPerChunk * 8; }
+
+  void clear() {
+    mChunks.clear();
+    mLastChunk = nullptr;
+    mSize = 0;
+  }
+
+protected:
+  std::unordered_map<uint64_t, std::unique_ptr<uint64_t[]>> mChunks;
+  uint64_t *mLastChunk = nullptr;
+  uint64_t mLastChunkIndex = 0;
+  uint64_t mSize = 0;
+};
+
+} // namespace GeoUtils
+
+#endif
@@ -1,6 +1,9 @@
 #include "osmsplitconfig.h"
+#include "boxgeometry.h"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 
 using std::cout;
 using std::endl;
@@ -71,14 +74,33 @@ void OSMSplitConfig::initFromJSON(const rapidjson::Value &value) {
     mSplit.second = make_shared<OSMSplitConfig>(value["splitMore"]);
   } else {
     if (abs(mExtents.top_right().lat() - mExtents.bottom_left().lat()) >
-        abs(mExtents.top_right().lat() - mExtents.bottom_left().lat())) {
+        abs(mExtents.top_right().lon() - mExtents.bottom_left().lon())) {
       mSortByLat = true;
     } else {
       mSortByLat = false;
     }
     mFileName = value["fileName"].GetString();
+
+    if (value.HasMember("contentExtents")) {
+      mContentBox = osmiumBoxFromJSON(value["contentExtents"]);
+    }
+
+    if (value.HasMember("stats")) {
+      const auto &stats = value["stats"];
+      mStats.bytes = stats["bytes"].GetUint64();
+      mStats.nodes = stats["nodes"].GetUint64();
+      mStats.ways = stats["ways"].GetUint64();
+      mStats.sharedWays = stats["sharedWays"].GetUint64();
+      mStats.writeSeconds = stats["writeSeconds"].GetDouble();
+    }
   }
 }
+OSMSplitConfig::OSMSplitConfigPair OSMSplitConfig::split(double midPoint,
+                                                         bool sortByLat) {
+  mSortByLat = sortByLat;
+  return split(midPoint);
+}
+
 OSMSplitConfig::OSMSplitConfigPair OSMSplitConfig::split(double midPoint) {
   mMidPoint = midPoint;
 
@@ -120,6 +142,21 @@ OSMSplitConfig::toJson(rapidjson::Document::AllocatorType &allocJS) const {
   } else {
 
     configJS.AddMember("fileName", mFileName.string(), allocJS);
+
+    if (mContentBox.valid()) {
+      configJS.AddMember("contentExtents",
+                         osmiumBoxToJSON(mContentBox, allocJS), allocJS);
+    }
+
+    if (mStats.bytes) {
+      rapidjson::Value statsJS(rapidjson::kObjectType);
+      statsJS.AddMember("bytes", mStats.bytes, allocJS);
+      statsJS.AddMember("nodes", mStats.nodes, allocJS);
+      statsJS.AddMember("ways", mStats.ways, allocJS);
+      statsJS.AddMember("sharedWays", mStats.sharedWays, allocJS);
+      statsJS.AddMember("writeSeconds", mStats.writeSeconds, allocJS);
+      configJS.AddMember("stats", statsJS, allocJS);
+    }
   }
 
   return configJS;
@@ -174,4 +211,120 @@ OSMConfigList OSMSplitConfig::getLeafNodes() const {
 fs::path OSMSplitConfig::getFileName() const {
   return mFileName.string() + suffix().string();
 }
+
+OSMSplitTree::OSMSplitTree(const OSMSplitConfigPtr &root)
+    : mExtents(root->getBox()) {
+  add(root);
+  mContentNodes = mNodes;
+  addContent(0);
+}
+
+uint32_t OSMSplitTree::add(const OSMSplitConfigPtr &config) {
+
+  uint32_t index = mNodes.size();
+  mNodes.emplace_back();
+
+  if (config->isLeaf()) {
+    mNodes[index].leaf = mLeaves.size();
+    mLeaves.push_back(config);
+    return index;
+  }
+
+  const auto &less = config->splitLess();
+  const auto &more = config->splitMore();
+
+  SplitTreeNode node;
+  node.byLat = config->sortByLat();
+  node.lessMax = node.byLat ? less->getBox().top_right().y()
+                            : less->getBox().top_right().x();
+  node.moreMin = node.byLat ? more->getBox().bottom_left().y()
+                            : more->getBox().bottom_left().x();
+  node.less = add(less);
+  node.more = add(more);
+
+  mNodes[index] = node;
+  return index;
+}
+
+// bounds each side of the content node by the content boxes of the leaves
+// under it, a side without any gets bounds no location reaches. Returns the
+// content box of the subtree
+osmium::Box OSMSplitTree::addContent(uint32_t index) {
+
+  const SplitTreeNode &node = mNodes[index];
+
+  if (node.less == 0) {
+    return mLeaves[node.leaf]->getContentBox();
+  }
+
+  osmium::Box less = addContent(node.less);
+  osmium::Box more = addContent(node.more);
+
+  SplitTreeNode &content = mContentNodes[index];
+  content.lessMax = std::numeric_limits<int32_t>::min();
+  content.moreMin = std::numeric_limits<int32_t>::max();
+
+  if (less.valid()) {
+    content.lessMax = node.byLat ? less.top_right().y() : less.top_right().x();
+  }
+  if (more.valid()) {
+    content.moreMin =
+        node.byLat ? more.bottom_left().y() : more.bottom_left().x();
+  }
+
+  less.extend(more);
+  return less;
+}
+
+void OSMSplitTree::leavesForLocation(const osmium::Location &loc,
+                                     std::vector<LeafId> &result) const {
+
+  result.clear();
+
+  if (!loc.valid()) {
+    return;
+  }
+  GeoUtils::leavesForBox(mContentNodes.data(), 0, osmium::Box(loc, loc),
+                         result);
+
+  // the descent only tests one axis at each split
+  auto end = std::remove_if(result.begin(), result.end(), [&](LeafId leaf) {
+    const osmium::Box &box = mLeaves[leaf]->getContentBox();
+    return !box.valid() || !box.contains(loc);
+  });
+  result.erase(end, result.end());
+}
+
+void OSMSplitTree::leavesForBox(const osmium::Box &box,
+                                std::vector<LeafId> &result) const {
+
+  result.clear();
+
+  if (boxesOverlap(box, mExtents)) {
+    GeoUtils::leavesForBox(mNodes.data(), 0, box, result);
+  }
+}
+
+void leavesForBox(const SplitTreeNode *nodes, uint32_t index,
+                  const osmium::Box &box, std::vector<uint32_t> &result) {
+
+  const SplitTreeNode &node = nodes[index];
+
+  // only the root can be child 0, so that marks a leaf
+  if (node.less == 0) {
+    result.push_back(node.leaf);
+    return;
+  }
+
+  int32_t min = node.byLat ? box.bottom_left().y() : box.bottom_left().x();
+  int32_t max = node.byLat ? box.top_right().y() : box.top_right().x();
+
+  if (min <= node.lessMax) {
+    leavesForBox(nodes, node.less, box, result);
+  }
+  if (max >= node.moreMin) {
+    leavesForBox(nodes, node.more, box, result);
+  }
+}
+
 } // namespace GeoUtils
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <osmium/osm/box.hpp>
 #include <osmium/osm/location.hpp>
 
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <utility>
@@ -22,6 +23,17 @@ class OSMSplitConfig;
 using OSMSplitConfigPtr = std::shared_ptr<OSMSplitConfig>;
 using OSMConfigList = std::vector<OSMSplitConfigPtr>;
 
+// what the writer put in a leaf, so jobs on the leaves can be scheduled
+// without opening them
+struct LeafStats {
+  uint64_t bytes = 0;
+  uint64_t nodes = 0;
+  uint64_t ways = 0;
+  // ways that went to other leaves as well
+  uint64_t sharedWays = 0;
+  double writeSeconds = 0;
+};
+
 class OSMSplitConfig {
 
   using OSMSplitConfigPair = std::pair<OSMSplitConfigPtr, OSMSplitConfigPtr>;
@@ -34,6 +46,7 @@ public:
 
   void initFromJSON(const rapidjson::Value &);
   OSMSplitConfigPair split(double midPoint);
+  OSMSplitConfigPair split(double midPoint, bool sortByLat);
   void setFileName(const fs::path &fileName);
   static void setOutputSuffix(std::string s);
 
@@ -46,10 +59,20 @@ public:
   const osmium::Box &getBox() const { return mExtents; }
   bool sortByLat() const { return mSortByLat; }
   bool isLeaf() const { return mSplit.first == nullptr; }
+  // box around everything written to the leaf, ways crossing out of it
+  // take it past the leaf's own box
+  const osmium::Box &getContentBox() const { return mContentBox; }
+  void setContentBox(const osmium::Box &box) { mContentBox = box; }
+  const LeafStats &getStats() const { return mStats; }
+  void setStats(const LeafStats &stats) { mStats = stats; }
+  const OSMSplitConfigPtr &splitLess() const { return mSplit.first; }
+  const OSMSplitConfigPtr &splitMore() const { return mSplit.second; }
   static fs::path suffix() { return mSuffix; }
 
 protected:
   osmium::Box mExtents;
+  osmium::Box mContentBox;
+  LeafStats mStats;
   bool mSortByLat;
   double mMidPoint;
   OSMSplitConfigPair mSplit;
@@ -57,6 +80,63 @@ protected:
   static fs::path mSuffix;
 };
 
+// a node of the compiled split tree, children of a split or the leaf id when
+// there aren't any. A box goes to the less child when it starts at or below
+// lessMax along the axis and to the more child when it ends at or above
+// moreMin. Fixed width, as it's also how a mapped split tree stores them
+struct SplitTreeNode {
+  int32_t lessMax = 0;
+  int32_t moreMin = 0;
+  uint32_t less = 0;
+  uint32_t more = 0;
+  uint32_t leaf = 0;
+  uint32_t byLat = 0;
+};
+
+// appends the leaves under the node that the box touches, the box has to
+// be valid and within the tree's extents
+void leavesForBox(const SplitTreeNode *nodes, uint32_t index,
+                  const osmium::Box &box, std::vector<uint32_t> &result);
+
+// the split config compiled into an array, for assigning ways to leaves
+// without walking shared pointers or building lists of file names. Leaves
+// are numbered in the order getLeafNodes lists them
+class OSMSplitTree {
+public:
+  using LeafId = uint32_t;
+
+  OSMSplitTree(const OSMSplitConfigPtr &root);
+
+  // clears the result and fills it with the leaves the box touches, the
+  // caller keeps the vector around so it doesn't allocate once it's grown
+  void leavesForBox(const osmium::Box &box, std::vector<LeafId> &result) const;
+
+  // clears the result and fills it with the leaves whose content box holds
+  // the location
+  void leavesForLocation(const osmium::Location &loc,
+                         std::vector<LeafId> &result) const;
+
+  const OSMConfigList &leaves() const { return mLeaves; }
+  size_t numLeaves() const { return mLeaves.size(); }
+  const std::vector<SplitTreeNode> &nodes() const { return mNodes; }
+  const std::vector<SplitTreeNode> &contentNodes() const {
+    return mContentNodes;
+  }
+  const osmium::Box &extents() const { return mExtents; }
+
+protected:
+  uint32_t add(const OSMSplitConfigPtr &config);
+  osmium::Box addContent(uint32_t index);
+
+  osmium::Box mExtents;
+  std::vector<SplitTreeNode> mNodes;
+
+  // the same tree split on the leaves' content boxes, which spread past the
+  // leaves' own boxes where ways cross them
+  std::vector<SplitTreeNode> mContentNodes;
+  OSMConfigList mLeaves;
+};
+
 } // namespace GeoUtils
 
 #endif
\ No newline at end of file
@@ -1,12 +1,21 @@
 #include "osmsplitwriter.h"
+#include "boxgeometry.h"
 #include "osmsplitconfig.h"
+#include "pbfblobs.h"
+#include "splitindex.h"
 
 #include <osmium/builder/attr.hpp>
 #include <osmium/builder/osm_object_builder.hpp>
-#include <osmium/io/input_iterator.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <exception>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
 #include <list>
+#include <thread>
 
 using std::cout;
 using std::endl;
@@ -14,116 +23,634 @@ using std::string;
 
 namespace GeoUtils {
 
-OSMSplitWriter::LockWriter::LockWriter(fs::path outFilePath,
-                                       osmium::io::Header &header) {
+// number of decoded buffers allowed to queue up per worker thread
+const int queueBuffersPerThread = 4;
+
+// size a worker's per leaf way buffer reaches before it's handed over, the
+// buffers start smaller as most leaves only see a few ways from each worker
+const size_t leafBatchSize = 1024 * 1024;
+const size_t leafBatchInitialSize = 16 * 1024;
+
+// memory a worker's batches may hold in total before they're all handed over,
+// this keeps deep splits with many thousands of leaves bounded
+const size_t workerBatchBytes = 64 * 1024 * 1024;
+
+// starting size of a worker's buffer for the nodes of ways going to more than
+// one leaf, it grows to fit the longest way and stays that size
+const size_t nodeArenaSize = 64 * 1024;
+
+// position of the invalid buffer that has the workers wait for a checkpoint
+const uint64_t checkpointMarker = UINT64_MAX;
+
+// purging a buffer asks to be told about moved items, nothing here holds
+// offsets into the batches
+struct IgnoreMoves {
+  void moving_in_buffer(size_t, size_t) {}
+};
+
+void OSMSplitWriter::WriterStats::print() const {
+  cout << tfm::format("Writer hand overs : %d, lock time : %.3fs",
+                      mHandOvers.load(), mLockNanos.load() / 1e9)
+       << endl;
+
+  uint64_t written = std::max<uint64_t>(1, mNodesWritten.load());
+  cout << tfm::format("Nodes written : %d of %d references, dedup ratio "
+                      "%.2f, node set mem : %d",
+                      mNodesWritten.load(), mNodeRefs.load(),
+                      (double)mNodeRefs.load() / written, mNodeSetBytes.load())
+       << endl;
+
+  cout << tfm::format("Segment writers opened : %d, closed early : %d",
+                      mWriterOpens.load(), mWriterEvictions.load())
+       << endl;
+
+  if (mClippedWays.load()) {
+    cout << tfm::format("Way copies clipped at leaf boundaries : %d, node "
+                        "copies saved : %d",
+                        mClippedWays.load(), mClippedNodes.load())
+         << endl;
+  }
+
+  cout << tfm::format("Segment blobs joined : %d from %d segments",
+                      mBlobs.load(), mSegments.load())
+       << endl;
+
+  cout << tfm::format("Buffer allocations : %d for %d ways, %.4f per way",
+                      mBufferAllocs.load(), mWays.load(),
+                      (double)mBufferAllocs.load() /
+                          std::max<uint64_t>(1, mWays.load()))
+       << endl;
+}
+
+void OSMSplitWriter::WriterPool::use(LockWriter *writer, WriterStats &stats) {
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (writer->mPooled) {
+    mOpen.splice(mOpen.begin(), mOpen, writer->mPoolPos);
+    return;
+  }
+
+  while (mOpen.size() >= mLimit) {
+
+    // leaves busy on another thread are skipped rather than waited for, the
+    // limit is at least one more than the number of threads so there's
+    // always one to close
+    LockWriter *victim = nullptr;
+    for (auto it = mOpen.rbegin(); it != mOpen.rend(); ++it) {
+      if ((*it)->mMutex->try_lock()) {
+        victim = *it;
+        break;
+      }
+    }
+    if (victim == nullptr) {
+      break;
+    }
+
+    mOpen.erase(victim->mPoolPos);
+    victim->mPooled = false;
+
+    lock.unlock();
+    victim->closeSegments();
+    victim->mMutex->unlock();
+    stats.mWriterEvictions++;
+    lock.lock();
+  }
+
+  writer->openSegments();
+  stats.mWriterOpens++;
+
+  mOpen.push_front(writer);
+  writer->mPoolPos = mOpen.begin();
+  writer->mPooled = true;
+}
+
+void OSMSplitWriter::WriterPool::release(LockWriter *writer) {
+
+  std::lock_guard<std::mutex> g(mMutex);
+
+  if (writer->mPooled) {
+    mOpen.erase(writer->mPoolPos);
+    writer->mPooled = false;
+  }
+}
+
+OSMSplitWriter::LeafBatch::LeafBatch()
+    : mNodes(leafBatchInitialSize, osmium::memory::Buffer::auto_grow::yes),
+      mWays(leafBatchInitialSize, osmium::memory::Buffer::auto_grow::yes) {}
 
-  auto filename = outFilePath.filename().string();
-  auto dotPos = filename.find(".");
-  auto basename = filename.substr(0, dotPos) + std::string("_ways");
-  auto dir = outFilePath.parent_path();
-  mOutWayPath =
-      dir / fs::path(basename).replace_extension(OSMSplitConfig::suffix());
+void OSMSplitWriter::LeafBatch::add(const osmium::memory::Buffer &nodes,
+                                    const osmium::Way &way) {
+  mNodes.add_buffer(nodes);
+  mNodes.commit();
+  add(way);
+}
+
+// for when the way's nodes were built straight into mNodes, or the way
+// carries their locations instead
+void OSMSplitWriter::LeafBatch::add(const osmium::Way &way,
+                                    const osmium::Location *locations) {
+  auto &copy = mWays.add_item(way);
+  mWays.commit();
+
+  if (locations) {
+    auto &nodes = copy.nodes();
+    for (size_t i = 0; i < nodes.size(); i++) {
+      nodes[i].set_location(locations[i]);
+    }
+  }
+}
+
+// the way with only its nodes from first to last
+void OSMSplitWriter::LeafBatch::add(const osmium::Way &way, size_t first,
+                                    size_t last,
+                                    const osmium::Location *locations) {
+  {
+    osmium::builder::WayBuilder builder{mWays};
+    builder.set_id(way.id())
+        .set_visible(way.visible())
+        .set_version(way.version())
+        .set_changeset(way.changeset())
+        .set_uid(way.uid())
+        .set_timestamp(way.timestamp());
+    builder.set_user(way.user());
+    builder.add_item(way.tags());
+
+    osmium::builder::WayNodeListBuilder nodes{builder};
+    for (size_t i = first; i <= last; i++) {
+      nodes.add_node_ref(way.nodes()[i].ref(),
+                         locations ? locations[i] : osmium::Location());
+    }
+  }
+  mWays.commit();
+}
 
-  mWayWriter = std::make_shared<osmium::io::Writer>(
-      osmium::io::File(mOutWayPath.string()), header,
-      osmium::io::overwrite::allow);
-  mWriter = std::make_shared<osmium::io::Writer>(
-      osmium::io::File(outFilePath.string()), header,
-      osmium::io::overwrite::allow);
+bool OSMSplitWriter::LeafBatch::full() const {
+  return mNodes.committed() + mWays.committed() >= leafBatchSize;
+}
 
-  std::cout << "LockWritert out " << outFilePath << std::endl;
+OSMSplitWriter::LockWriter::LockWriter(fs::path outFilePath,
+                                       const osmium::io::Header &header,
+                                       const LeafOutput *output,
+                                       StagingBudget *budget,
+                                       WriterPool *pool)
+    : mOutPath(outFilePath), mHeader(header), mOutput(output),
+      mBudget(budget), mPool(pool) {
+
+  std::cout << "LockWriter out " << outFilePath << std::endl;
 
   mMutex = std::shared_ptr<std::mutex>(new std::mutex());
 }
-void OSMSplitWriter::LockWriter::write(osmium::memory::Buffer &buffer,
-                                       const osmium::Way &way) {
 
-  osmium::memory::Buffer bufferCopy{buffer.data(), buffer.committed()};
+void OSMSplitWriter::LockWriter::write(LeafBatch &batch,
+                                       WriterStats &stats) {
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> g(*mMutex);
+    auto locked = std::chrono::steady_clock::now();
+
+    // ways sharing nodes all bring their own copy, only the first one is
+    // kept. The rest are purged in place so the batch's buffer can be kept
+    uint64_t refs = 0;
+    uint64_t unique = 0;
+    for (auto &node : batch.mNodes.select<osmium::Node>()) {
+      refs++;
+      if (firstWrite(node)) {
+        unique++;
+        mContentBox.extend(node.location());
+      } else {
+        node.set_removed(true);
+      }
+    }
+    stats.mNodeRefs += refs;
 
-  std::lock_guard<std::mutex> g(*mMutex);
+    size_t ways = 0;
+    if (mOutput->mLocationsOnWays) {
+      for (const auto &way : batch.mWays.select<osmium::Way>()) {
+        mContentBox.extend(way.envelope());
+        ways++;
+      }
+    } else {
+      auto selected = batch.mWays.select<osmium::Way>();
+      ways = std::distance(selected.begin(), selected.end());
+    }
+    mStagedNodes += unique;
+    mStagedWays += ways;
+    mWayCount += ways;
+    mSharedWays += batch.mSharedWays;
+
+    size_t added = batch.mWays.capacity();
+    if (unique) {
+      if (unique < refs) {
+        IgnoreMoves ignore;
+        batch.mNodes.purge_removed(&ignore);
+      }
+      added += batch.mNodes.capacity();
+      mNodes.push_back(std::move(batch.mNodes));
+    }
+    mWays.push_back(std::move(batch.mWays));
+
+    mStagedBytes += added;
+    size_t used = mBudget->mUsed += added;
+
+    // once the budget is used up, the leaves holding more than the average
+    // spill, so the big leaves go to disk and the many small ones stay. A
+    // spill waits for enough to fill a pbf blob, as every segment ends with
+    // a part filled one, unless the budget is well overrun. Nodes and ways
+    // go to different segments, so each kind staged has to fill its blobs
+    bool over =
+        used > mBudget->mBytes && mStagedBytes * mBudget->mLeaves >= used;
+    size_t blob = mOutput->mBlobEntities;
+    bool blobFull = (mStagedNodes == 0 || mStagedNodes >= blob) &&
+                    (mStagedWays == 0 || mStagedWays >= blob);
+    if (over && (blobFull || used > 2 * mBudget->mBytes)) {
+      spill(stats);
+    }
+
+    mWriteNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - locked)
+                       .count();
+  }
+  auto taken = std::chrono::steady_clock::now() - start;
+
+  stats.mLockNanos +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(taken).count();
+  stats.mHandOvers++;
+
+  batch = LeafBatch();
+  stats.mBufferAllocs += 2;
+}
+
+fs::path OSMSplitWriter::LockWriter::segmentPath(const char *type,
+                                                 size_t index) const {
+  auto name = mOutPath.filename().string();
+  name = name.substr(0, name.find(".")) + tfm::format(".%s%d.seg", type, index);
+  return mOutPath.parent_path() / name;
+}
 
-  (*mWriter)(std::move(bufferCopy));
-  (*mWayWriter)(way);
-  (*mWriter).flush();
+void OSMSplitWriter::LockWriter::writeBuffers(
+    osmium::io::Writer &writer, std::vector<osmium::memory::Buffer> &buffers) {
+  for (auto &buffer : buffers) {
+    writer(std::move(buffer));
+  }
+  buffers.clear();
+}
+
+// negative ids have a set of their own, they'd collide with positive ones
+bool OSMSplitWriter::LockWriter::firstWrite(const osmium::Node &node) {
+  auto &written = node.id() < 0 ? mWrittenNegativeNodes : mWrittenNodes;
+  return written.checkAndSet(node.positive_id());
+}
+
+// blocks are encoded and compressed by the shared pool, the writer's own
+// thread only writes them out
+std::shared_ptr<osmium::io::Writer>
+OSMSplitWriter::LockWriter::openWriter(const fs::path &path) const {
+  return std::make_shared<osmium::io::Writer>(
+      osmium::io::File(path.string(), mOutput->mFormat), mHeader,
+      osmium::io::overwrite::allow, *mOutput->mEncodePool);
+}
+
+void OSMSplitWriter::LockWriter::openSegments() {
+
+  auto nodePath = segmentPath("n", mNodeSegments.size());
+  mNodeWriter = openWriter(nodePath);
+  mNodeSegments.push_back(nodePath);
+
+  auto wayPath = segmentPath("w", mWaySegments.size());
+  mWayWriter = openWriter(wayPath);
+  mWaySegments.push_back(wayPath);
+}
+
+void OSMSplitWriter::LockWriter::closeSegments() {
+
+  if (mNodeWriter) {
+    mNodeWriter->close();
+    mNodeWriter = nullptr;
+  }
+  if (mWayWriter) {
+    mWayWriter->close();
+    mWayWriter = nullptr;
+  }
+}
+
+void OSMSplitWriter::LockWriter::spill(WriterStats &stats) {
+
+  // keeps writing to the segments opened by the last spill, unless the pool
+  // closed them in the meantime
+  mPool->use(this, stats);
+
+  writeBuffers(*mNodeWriter, mNodes);
+  writeBuffers(*mWayWriter, mWays);
+
+  mBudget->mUsed -= mStagedBytes;
+  mStagedBytes = 0;
+  mStagedNodes = 0;
+  mStagedWays = 0;
+}
+
+void OSMSplitWriter::LockWriter::writeSegment(
+    const char *type, std::vector<fs::path> &segments,
+    std::vector<osmium::memory::Buffer> &buffers) {
+
+  if (buffers.empty()) {
+    return;
+  }
+
+  auto path = segmentPath(type, segments.size());
+  auto writer = openWriter(path);
+  writeBuffers(*writer, buffers);
+  writer->close();
+  segments.push_back(path);
+}
+
+LeafStats OSMSplitWriter::LockWriter::leafStats() const {
+  LeafStats leafStats;
+  leafStats.bytes = fs::exists(mOutPath) ? fs::file_size(mOutPath) : 0;
+  leafStats.nodes = mNodeCount;
+  leafStats.ways = mWayCount;
+  leafStats.sharedWays = mSharedWays;
+  leafStats.writeSeconds = mWriteNanos / 1e9;
+  return leafStats;
+}
+
+// staged output goes to disk and the segments are closed so they're whole
+// pbf files, the next spill starts new ones
+void OSMSplitWriter::LockWriter::checkpoint(WriterStats &stats) {
+
+  if (!mNodes.empty() || !mWays.empty()) {
+    spill(stats);
+  }
+  mPool->release(this);
+  closeSegments();
 }
 
-void OSMSplitWriter::LockWriter::putWays() {
+// takes back the segments written up to the checkpoint, the ones written
+// after it are written again
+void OSMSplitWriter::LockWriter::resume(
+    const Checkpoint::LeafProgress &progress) {
+
+  auto take = [this](const char *type, std::vector<fs::path> &segments,
+                     size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      segments.push_back(segmentPath(type, i));
+    }
+    for (size_t i = count; fs::exists(segmentPath(type, i)); i++) {
+      fs::remove(segmentPath(type, i));
+    }
+  };
+  take("n", mNodeSegments, progress.nodeSegments);
+  take("w", mWaySegments, progress.waySegments);
+
+  mWayCount = progress.ways;
+  mSharedWays = progress.sharedWays;
+  mWriteNanos = progress.writeNanos;
+
+  // ways carrying their locations only need the content box back
+  if (mOutput->mLocationsOnWays) {
+    for (const auto &segment : mWaySegments) {
+      osmium::io::Reader reader{osmium::io::File(segment.string(), "pbf"),
+                                osmium::osm_entity_bits::way,
+                                *mOutput->mEncodePool};
+      while (osmium::memory::Buffer buffer = reader.read()) {
+        for (const auto &way : buffer.select<osmium::Way>()) {
+          mContentBox.extend(way.envelope());
+        }
+      }
+      reader.close();
+    }
+    return;
+  }
 
-  mWayWriter = nullptr;
+  // the nodes already written mustn't be written again
+  for (const auto &segment : mNodeSegments) {
+    osmium::io::Reader reader{osmium::io::File(segment.string(), "pbf"),
+                              osmium::osm_entity_bits::node,
+                              *mOutput->mEncodePool};
+    while (osmium::memory::Buffer buffer = reader.read()) {
+      for (const auto &node : buffer.select<osmium::Node>()) {
+        firstWrite(node);
+        mContentBox.extend(node.location());
+      }
+    }
+    reader.close();
+  }
+}
 
-  osmium::io::File f{mOutWayPath.string()};
-  osmium::io::Reader reader{f, osmium::osm_entity_bits::way};
-  auto ways = osmium::io::make_input_iterator_range<const osmium::Way>(reader);
+void OSMSplitWriter::LockWriter::finish(WriterStats &stats) {
 
-  for (auto &way : ways) {
-    (*mWriter)(way);
+  std::lock_guard<std::mutex> g(*mMutex);
+  auto start = std::chrono::steady_clock::now();
+
+  mPool->release(this);
+  closeSegments();
+
+  mNodeCount = mWrittenNodes.size() + mWrittenNegativeNodes.size();
+  stats.mNodesWritten += mNodeCount;
+  stats.mNodeSetBytes += mWrittenNodes.bytes() + mWrittenNegativeNodes.bytes();
+  mWrittenNodes.clear();
+  mWrittenNegativeNodes.clear();
+
+  if (mNodeSegments.empty() && mWaySegments.empty()) {
+
+    // everything fitted in memory, nodes first so readers can build their
+    // location index before the ways arrive
+    auto writer = openWriter(mOutPath);
+    writeBuffers(*writer, mNodes);
+    writeBuffers(*writer, mWays);
+    writer->close();
+  } else {
+
+    writeSegment("n", mNodeSegments, mNodes);
+    writeSegment("w", mWaySegments, mWays);
+
+    {
+      // header only file that the already encoded segments get appended to
+      openWriter(mOutPath)->close();
+    }
+
+    std::ofstream out(mOutPath, std::ios::binary | std::ios::app);
+
+    for (auto &segment : mNodeSegments) {
+      stats.mBlobs += appendDataBlobs(segment, out);
+      fs::remove(segment);
+    }
+    for (auto &segment : mWaySegments) {
+      stats.mBlobs += appendDataBlobs(segment, out);
+      fs::remove(segment);
+    }
+    stats.mSegments += mNodeSegments.size() + mWaySegments.size();
+    mNodeSegments.clear();
+    mWaySegments.clear();
   }
 
-  mWriter = nullptr;
+  mBudget->mUsed -= mStagedBytes;
+  mStagedBytes = 0;
+  mStagedNodes = 0;
+  mStagedWays = 0;
 
-  std::cout << "LockWritert way out " << mOutWayPath << std::endl;
+  mWriteNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
 
-  fs::remove(mOutWayPath);
+  std::cout << "LockWriter finished " << mOutPath << std::endl;
 }
 
 OSMSplitWriter::OSMSplitWriter(OSMSplitConfigPtr rootConfig, fs::path inputFile,
                                fs::path outputDirectory,
-                               NodeLocatorMap &locStore, int numThreads,
-                               uint64_t wayCount)
+                               NodeLocations &locStore,
+                               WayBoxTable wayBoxes,
+                               const SplitOptions &options,
+                               Checkpoint *checkpoint)
 
-    : mInputFileName(inputFile), mRootConfig(rootConfig),
-      mNodeLocatorStore(locStore)
+    : mInputFileName(inputFile), mTree(rootConfig),
+      mNodeLocatorStore(locStore), mWayBoxes(std::move(wayBoxes)),
+      mJoinLocations(options.joinLocations), mClipWays(options.clipWays),
+      mCheckpoint(checkpoint)
 
 {
-  int outCount = 0;
+  const auto &configList = mTree.leaves();
+
+  int numThreads = std::max(1, options.threadNum);
+
+  mBudget.mBytes = size_t(options.stagingMemMB) * 1024 * 1024;
+  mBudget.mLeaves = std::max<size_t>(1, configList.size());
 
-  auto configList = rootConfig->getLeafNodes();
+  mPool.mLimit = std::max<size_t>(options.maxOpenWriters, numThreads + 1);
+
+  mOutput.mFormat = "pbf";
+  if (options.locationsOnWays) {
+    mOutput.mFormat += ",locations_on_ways=true";
+  }
+  if (options.compressionLevel == 0) {
+    mOutput.mFormat += ",pbf_compression=none";
+  } else if (options.compressionLevel > 0) {
+    mOutput.mFormat +=
+        tfm::format(",pbf_compression_level=%d", options.compressionLevel);
+  }
+  mOutput.mLocationsOnWays = options.locationsOnWays;
+  mOutput.mBlobEntities = std::max(1, options.blobEntities);
+  mOutput.mEncodePool = options.encodePool
+                            ? options.encodePool
+                            : &osmium::thread::Pool::default_instance();
+
+  // named like the config file, which is written next to the leaves
+  if (options.keepIndex) {
+    mIndexPrefix =
+        outputDirectory / mInputFileName.filename().replace_extension("");
+    mWayIds.resize(mWayBoxes.size());
+  }
+
+  // the pool keeps pointers to the writers, so the list mustn't grow after
+  mWriters.reserve(configList.size());
 
   for (auto &config : configList) {
 
-    auto outFileName = config->getFileName();
-    auto outFilePath = outputDirectory / outFileName;
+    auto outFilePath = outputDirectory / config->getFileName();
 
     osmium::io::Header header;
     header.set("generator", "osmsplit");
     header.add_box(config->getBox());
 
-    mWriterMap[outFileName] = LockWriter(outFilePath, header);
+    mWriters.emplace_back(outFilePath, header, &mOutput, &mBudget, &mPool);
+  }
+
+  if (mCheckpoint) {
+    mFirstWay = mCheckpoint->waysDone();
+    mInputOffset = mCheckpoint->inputOffset();
+
+    if (mFirstWay) {
+      std::cout << "Resuming from way " << mFirstWay << std::endl;
+
+      mOpCount.setOps(mWriters.size());
+      forEachLeaf(numThreads, [&](size_t leaf) {
+        auto &w = mWriters[leaf];
+        w.mDone = mCheckpoint->leafDone(configList[leaf]);
+        if (w.mDone) {
+          w.mContentBox = configList[leaf]->getContentBox();
+        } else {
+          w.resume(mCheckpoint->leafProgress(configList[leaf]));
+        }
+      });
+    }
   }
 
-  mOpCount.setOps(wayCount + mWriterMap.size());
+  // a run that was killed after this pass only has leaves left to finish,
+  // unless the way ids for the index have to be read again
+  if (mFirstWay < mWayBoxes.size() || !mWayIds.empty()) {
 
-  uint64_t countPerThread = wayCount / numThreads;
-  uint64_t start = 0;
+    mOpCount.setOps(mWayBoxes.size() - mFirstWay + mWriters.size());
 
-  std::list<std::thread> threads;
-  for (int i = 0; i < numThreads; i++) {
+    mBarrier = std::make_unique<std::barrier<>>(numThreads + 1);
+
+    // one reader decodes the input once and fans the way buffers out to the
+    // workers, so decode cost doesn't grow with the thread count
+    BufferQueue queue(numThreads * queueBuffersPerThread, "osmsplit_ways");
+
+    std::list<std::thread> threads;
+    for (int i = 0; i < numThreads; i++) {
 
-    uint64_t len = countPerThread;
-    if (wayCount < start + len) {
-      len = wayCount - start;
+      threads.push_back(
+          std::thread(&OSMSplitWriter::writeWays, this, std::ref(queue)));
     }
 
-    threads.push_back(
-        std::thread(&OSMSplitWriter::writeWays, this, start, len));
-    start += len;
+    // the workers are stopped and joined before a read error is passed on,
+    // destroying threads that are still running would terminate
+    try {
+      readWays(queue, numThreads);
+    } catch (...) {
+      for (int i = 0; i < numThreads; i++) {
+        queue.push({osmium::memory::Buffer{}, 0});
+      }
+      for (auto &t : threads) {
+        t.join();
+      }
+      throw;
+    }
+
+    for (auto &t : threads) {
+      t.join();
+    }
+
+    if (mCheckpoint) {
+      checkpoint(mWayBoxes.size(), mInputOffset);
+    }
   }
 
-  for (auto &t : threads) {
-    t.join();
+  if (!mIndexPrefix.empty()) {
+    std::cout << "Writing index " << mIndexPrefix << std::endl;
+    // changes from the server never have negative ids, so only the positive
+    // ones are indexed
+    SplitIndex::write(mIndexPrefix, mNodeLocatorStore.positive, mWayIds,
+                      mWayBoxes);
+    std::vector<osmium::unsigned_object_id_type>().swap(mWayIds);
   }
 
   mNodeLocatorStore.clear();
+  WayBoxTable().swap(mWayBoxes);
+
+  std::cout << "Consolidate files: " << mWriters.size() << std::endl;
+
+  mOpCount.setOps(mWriters.size());
+
+  forEachLeaf(numThreads, [this](size_t leaf) { finishLeaf(leaf); });
+
+  for (size_t leaf = 0; leaf < mWriters.size(); leaf++) {
+    configList[leaf]->setContentBox(mWriters[leaf].mContentBox);
+  }
 
-  std::cout << "Consolidate files: " << mWriterMap.size() << std::endl;
+  mStats.print();
+}
 
-  mOpCount.setOps(mWriterMap.size());
+// runs the function for every leaf, on up to numThreads threads at a time
+void OSMSplitWriter::forEachLeaf(
+    size_t numThreads, const std::function<void(size_t)> &leafFunc) {
 
-  threads.clear();
-  for (auto &w : mWriterMap) {
+  std::list<std::thread> threads;
+  for (size_t leaf = 0; leaf < mWriters.size(); leaf++) {
 
-    threads.push_back(
-        std::thread(&OSMSplitWriter::LockWriter::putWays, &w.second));
+    threads.push_back(std::thread(leafFunc, leaf));
 
     if (threads.size() == numThreads) {
       for (auto &t : threads) {
@@ -139,49 +666,351 @@ OSMSplitWriter::OSMSplitWriter(OSMSplitConfigPtr rootConfig, fs::path inputFile,
   }
 }
 
+void OSMSplitWriter::finishLeaf(size_t leaf) {
+
+  auto &w = mWriters[leaf];
+  if (w.mDone) {
+    return;
+  }
+  w.finish(mStats);
+
+  const auto &config = mTree.leaves()[leaf];
+  config->setStats(w.leafStats());
+
+  if (mCheckpoint) {
+    config->setContentBox(w.mContentBox);
+    mCheckpoint->markLeafDone(config, mInputOffset);
+  }
+}
+
+// called with the workers waiting, so nothing else holds a leaf
+void OSMSplitWriter::checkpoint(uint64_t waysDone, uint64_t inputOffset) {
+
+  const auto &configList = mTree.leaves();
+  std::map<std::string, Checkpoint::LeafProgress> leaves;
+
+  for (size_t leaf = 0; leaf < mWriters.size(); leaf++) {
+    auto &w = mWriters[leaf];
+    std::lock_guard<std::mutex> g(*w.mMutex);
+
+    w.checkpoint(mStats);
+
+    auto &progress = leaves[configList[leaf]->getFileName().string()];
+    progress.nodeSegments = w.mNodeSegments.size();
+    progress.waySegments = w.mWaySegments.size();
+    progress.ways = w.mWayCount;
+    progress.sharedWays = w.mSharedWays;
+    progress.writeNanos = w.mWriteNanos;
+  }
+
+  mCheckpoint->saveProgress(waysDone, inputOffset, leaves);
+
+  std::cout << tfm::format("Checkpoint at way %d, input offset %d", waysDone,
+                           inputOffset)
+            << std::endl;
+}
+
 using namespace osmium::builder::attr;
-const size_t initial_buffer_size = 16;
 
-void OSMSplitWriter::writeWays(uint64_t start, uint64_t num) {
+void OSMSplitWriter::readWays(BufferQueue &queue, int numWorkers) {
   osmium::io::File f{mInputFileName.string()};
-  osmium::io::Reader reader{f, osmium::osm_entity_bits::way};
-  auto ways = osmium::io::make_input_iterator_range<const osmium::Way>(reader);
+  osmium::io::Reader reader{f, osmium::osm_entity_bits::way,
+                            *mOutput.mEncodePool};
+
+  uint64_t nextWay = 0;
+  while (osmium::memory::Buffer buffer = reader.read()) {
+    auto ways = buffer.select<osmium::Way>();
+    uint64_t firstWay = nextWay;
+    nextWay += std::distance(ways.begin(), ways.end());
+
+    // buffers that were written before the run resumed are still decoded,
+    // pbf can't be read from part way through, but nothing more
+    if (nextWay <= mFirstWay) {
+      if (!mWayIds.empty()) {
+        for (const auto &way : ways) {
+          mWayIds[firstWay++] = way.positive_id();
+        }
+      }
+      continue;
+    }
 
-  uint64_t count = 0;
-  int opCount = 0;
-  for (auto &way : ways) {
+    queue.push({std::move(buffer), firstWay});
 
-    count++;
-    if (count - 1 < start)
-      continue;
-    if (count - 1 >= start + num)
-      break;
+    // the workers hand over what they hold and wait on the barrier while
+    // every leaf is brought to disk, then wait again until it's recorded
+    if (mCheckpoint && mCheckpoint->due()) {
+      for (int i = 0; i < numWorkers; i++) {
+        queue.push({osmium::memory::Buffer{}, checkpointMarker});
+      }
+      mBarrier->arrive_and_wait();
+      std::exception_ptr error;
+      try {
+        checkpoint(nextWay, reader.offset());
+      } catch (...) {
+        error = std::current_exception();
+      }
+      // let the workers go on either way, so they can be stopped
+      mBarrier->arrive_and_wait();
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  }
+  mInputOffset = reader.offset();
+  reader.close();
 
-    osmium::Box boxForWay;
+  for (int i = 0; i < numWorkers; i++) {
+    queue.push({osmium::memory::Buffer{}, 0});
+  }
+}
 
-    osmium::memory::Buffer wayBuffer{initial_buffer_size,
-                                     osmium::memory::Buffer::auto_grow::yes};
+void OSMSplitWriter::flushBatches(LeafBatchList &batches) {
+  for (size_t leaf = 0; leaf < batches.size(); leaf++) {
+    if (batches[leaf] && !batches[leaf]->empty()) {
+      mWriters[leaf].write(*batches[leaf], mStats);
+    }
+  }
+}
 
-    for (const auto &node : way.nodes()) {
+// locations are either the way's already joined ones or looked up one by one.
+// Nodes missing from the input are left out, as they are from the way's box
+void OSMSplitWriter::addNodes(osmium::memory::Buffer &buffer,
+                              const osmium::Way &way,
+                              const osmium::Location *locations, size_t first,
+                              size_t last) {
+  const auto &nodes = way.nodes();
+  last = std::min(last, nodes.size() - 1);
 
-      const osmium::Location &loc = mNodeLocatorStore.get(node.ref());
+  for (size_t i = first; i <= last && i < nodes.size(); i++) {
 
-      boxForWay.extend(loc);
+    auto ref = nodes[i].ref();
+    osmium::Location loc =
+        locations ? locations[i] : mNodeLocatorStore.get_noexcept(ref);
 
-      osmium::builder::add_node(wayBuffer, _id(node.ref()), _location(loc));
+    if (!loc.valid()) {
+      continue;
     }
 
-    wayBuffer.commit();
+    osmium::builder::add_node(buffer, _id(ref), _location(loc));
+  }
+}
 
-    auto fileList = mRootConfig->filesForBox(boxForWay);
+bool OSMSplitWriter::clipRange(const osmium::Location *locations, size_t count,
+                               const osmium::Box &box, ClipRange &range) {
 
-    for (auto &file : fileList) {
-      mWriterMap[file].write(wayBuffer, way);
+  bool found = false;
+  for (size_t i = 0; i + 1 < count; i++) {
+    if (locations[i].valid() && locations[i + 1].valid() &&
+        segmentInBox(locations[i], locations[i + 1], box)) {
+      if (!found) {
+        range.first = i;
+        found = true;
+      }
+      range.second = i + 1;
     }
+  }
+  return found;
+}
+
+void OSMSplitWriter::writeWays(BufferQueue &queue) {
 
-    if (opCount++ > mOpCount.totalOps() / 100) {
-      mOpCount.countOff(opCount);
-      opCount = 0;
+  LeafBatchList batches(mWriters.size());
+  size_t batchBytes = 0;
+
+  std::vector<OSMSplitTree::LeafId> leaves;
+
+  osmium::memory::Buffer arena{nodeArenaSize,
+                               osmium::memory::Buffer::auto_grow::yes};
+  uint64_t ways = 0;
+  uint64_t allocs = 1;
+
+  LocationJoin<NodeLocatorMap> join(mNodeLocatorStore.positive,
+                                    &mNodeLocatorStore.negative);
+
+  std::vector<osmium::Location> wayLocations;
+  std::vector<ClipRange> clipRanges;
+  uint64_t clippedWays = 0;
+  uint64_t clippedNodes = 0;
+
+  int opCount = 0;
+  while (true) {
+
+    WayBuffer wayBuffers;
+    queue.wait_and_pop(wayBuffers);
+
+    auto &buffer = wayBuffers.first;
+    uint64_t wayIndex = wayBuffers.second;
+
+    if (!buffer) {
+      flushBatches(batches);
+
+      if (wayIndex == checkpointMarker) {
+        for (auto &batch : batches) {
+          batch.reset();
+        }
+        batchBytes = 0;
+        mBarrier->arrive_and_wait();
+        mBarrier->arrive_and_wait();
+        continue;
+      }
+
+      mStats.mWays += ways;
+      mStats.mBufferAllocs += allocs;
+      mStats.mClippedWays += clippedWays;
+      mStats.mClippedNodes += clippedNodes;
+      break;
+    }
+
+    // the whole buffer's node references are resolved in one go, each way
+    // then takes its run of locations
+    if (mJoinLocations) {
+      join.clear();
+      for (const auto &way : buffer.select<osmium::Way>()) {
+        join.add(way);
+      }
+      join.resolve();
+    }
+    size_t joined = 0;
+
+    for (const auto &way : buffer.select<osmium::Way>()) {
+
+      const osmium::Location *locations = nullptr;
+      if (mJoinLocations) {
+        locations = join.locations() + joined;
+        joined += way.nodes().size();
+      }
+
+      if (!mWayIds.empty()) {
+        mWayIds[wayIndex] = way.positive_id();
+      }
+
+      // written by the run this one resumed from
+      if (wayIndex < mFirstWay) {
+        wayIndex++;
+        continue;
+      }
+
+      // the box was worked out in the first pass, ways none of whose nodes
+      // were found don't belong anywhere
+      const osmium::Box &boxForWay = mWayBoxes[wayIndex++];
+
+      if (!boxForWay.valid()) {
+        continue;
+      }
+
+      mTree.leavesForBox(boxForWay, leaves);
+      ways++;
+
+      size_t numNodes = way.nodes().size();
+
+      // open ways crossing leaves are cut down to the run of nodes from the
+      // first segment passing through each leaf to the last, so every leaf
+      // gets one node past its boundary and none that its box only touches.
+      // Closed ways stay whole as they may be areas
+      bool clip = mClipWays && leaves.size() > 1 && numNodes > 1 &&
+                  !way.is_closed();
+
+      // clipping and locations on ways both need all the way's locations
+      if ((clip || mOutput.mLocationsOnWays) && !locations) {
+        wayLocations.clear();
+        for (const auto &node : way.nodes()) {
+          wayLocations.push_back(
+              mNodeLocatorStore.get_noexcept(node.ref()));
+        }
+        locations = wayLocations.data();
+      }
+
+      if (clip) {
+        clipRanges.clear();
+        bool any = false;
+        for (auto leaf : leaves) {
+          ClipRange range{1, 0};
+          any |= clipRange(locations, numNodes,
+                           mTree.leaves()[leaf]->getBox(), range);
+          clipRanges.push_back(range);
+        }
+        // ways with too few known nodes to have a segment go in whole
+        clip = any;
+      }
+
+      // most ways are in one leaf and get their nodes built straight into
+      // its batch, the others get them built once into the arena and copied.
+      // With locations on ways there are no nodes to build
+      bool shared = !clip && !mOutput.mLocationsOnWays && leaves.size() > 1;
+      if (shared) {
+        size_t capacity = arena.capacity();
+        arena.clear();
+        addNodes(arena, way, locations);
+        allocs += arena.capacity() != capacity;
+      }
+
+      for (size_t l = 0; l < leaves.size(); l++) {
+        auto leaf = leaves[l];
+
+        ClipRange range{0, numNodes - 1};
+        if (clip) {
+          range = clipRanges[l];
+          if (range.first > range.second) {
+            clippedWays++;
+            clippedNodes += numNodes;
+            continue;
+          }
+          clippedNodes += numNodes - (range.second - range.first + 1);
+        }
+
+        size_t before = 0;
+        if (batches[leaf]) {
+          before = batches[leaf]->capacity();
+        } else {
+          batches[leaf] = std::make_unique<LeafBatch>();
+          allocs += 2;
+        }
+        auto &batch = *batches[leaf];
+
+        size_t nodesCapacity = batch.mNodes.capacity();
+        size_t waysCapacity = batch.mWays.capacity();
+
+        if (shared) {
+          batch.add(arena, way);
+        } else {
+          const osmium::Location *onWay = nullptr;
+          if (mOutput.mLocationsOnWays) {
+            onWay = locations;
+          } else {
+            addNodes(batch.mNodes, way, locations, range.first, range.second);
+          }
+          if (range.first == 0 && range.second == numNodes - 1) {
+            batch.add(way, onWay);
+          } else {
+            batch.add(way, range.first, range.second, onWay);
+            clippedWays++;
+          }
+        }
+
+        allocs += (batch.mNodes.capacity() != nodesCapacity) +
+                  (batch.mWays.capacity() != waysCapacity);
+
+        batch.mSharedWays += leaves.size() > 1;
+
+        if (batch.full()) {
+          mWriters[leaf].write(batch, mStats);
+        }
+        batchBytes += batch.capacity();
+        batchBytes -= before;
+      }
+
+      if (batchBytes > workerBatchBytes) {
+        flushBatches(batches);
+        for (auto &batch : batches) {
+          batch.reset();
+        }
+        batchBytes = 0;
+      }
+
+      if (opCount++ > mOpCount.totalOps() / 100) {
+        mOpCount.countOff(opCount);
+        opCount = 0;
+      }
     }
   }
 }
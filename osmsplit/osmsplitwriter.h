@@ -1,9 +1,17 @@
 #ifndef OSMSPLIT_WRITER
 #define OSMSPLIT_WRITER
 
+#include <atomic>
+#include <barrier>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <vector>
 
 #include <osmium/io/any_input.hpp>
 #include <osmium/io/any_output.hpp>
@@ -11,43 +19,207 @@
 #include <osmium/io/reader.hpp>
 #include <osmium/io/writer.hpp>
 #include <osmium/osm/way.hpp>
+#include <osmium/thread/pool.hpp>
+#include <osmium/thread/queue.hpp>
 
+#include "checkpoint.h"
+#include "locationjoin.h"
 #include "main.h"
+#include "nodeidset.h"
 #include "osmsplitconfig.h"
 
 namespace GeoUtils {
 
 class OSMSplitWriter {
 
+  // decoded way buffers handed from the single reader to the worker threads,
+  // with the position of the buffer's first way in the way box table. An
+  // invalid (default constructed) buffer tells a worker to stop, or to hand
+  // over its batches and wait while a checkpoint is written when its
+  // position is checkpointMarker
+  using WayBuffer = std::pair<osmium::memory::Buffer, uint64_t>;
+  using BufferQueue = osmium::thread::Queue<WayBuffer>;
+
+  struct WriterStats {
+    std::atomic<uint64_t> mLockNanos{0};
+    std::atomic<uint64_t> mHandOvers{0};
+    std::atomic<uint64_t> mNodeRefs{0};
+    std::atomic<uint64_t> mNodesWritten{0};
+    std::atomic<uint64_t> mNodeSetBytes{0};
+    std::atomic<uint64_t> mWriterOpens{0};
+    std::atomic<uint64_t> mWriterEvictions{0};
+    std::atomic<uint64_t> mWays{0};
+    std::atomic<uint64_t> mBufferAllocs{0};
+    std::atomic<uint64_t> mClippedWays{0};
+    std::atomic<uint64_t> mClippedNodes{0};
+    std::atomic<uint64_t> mBlobs{0};
+    std::atomic<uint64_t> mSegments{0};
+
+    void print() const;
+  };
+
+  struct LockWriter;
+
+  // keeps the segment writers of the leaves that spilled most recently open,
+  // each has its own output thread and buffers. When another leaf needs them
+  // and the limit is reached, the least recently used leaf's are closed
+  struct WriterPool {
+    size_t mLimit = 0;
+    std::mutex mMutex;
+    std::list<LockWriter *> mOpen;
+
+    // both called holding the leaf's lock
+    void use(LockWriter *writer, WriterStats &stats);
+    void release(LockWriter *writer);
+  };
+
+  // how the leaves are encoded. A pbf blob holds up to 8000 entities, spills
+  // wait for a blob's worth so the joined segments aren't mostly part filled
+  // blobs. Blocks are compressed on the pool, shared by every leaf
+  struct LeafOutput {
+    std::string mFormat = "pbf";
+    bool mLocationsOnWays = false;
+    size_t mBlobEntities = 8000;
+    osmium::thread::Pool *mEncodePool = nullptr;
+  };
+
+  // memory shared by all leaves for staging their output, leaves that hold
+  // more than their share spill once it's used up
+  struct StagingBudget {
+    size_t mBytes = 0;
+    size_t mLeaves = 1;
+    std::atomic<size_t> mUsed{0};
+  };
+
+  // ways and their nodes gathered by one worker for one leaf, handed to the
+  // leaf's writers in one go once the batch is full
+  struct LeafBatch {
+
+    osmium::memory::Buffer mNodes;
+    osmium::memory::Buffer mWays;
+    uint64_t mSharedWays = 0;
+
+    LeafBatch();
+    void add(const osmium::memory::Buffer &nodes, const osmium::Way &way);
+    void add(const osmium::Way &way,
+             const osmium::Location *locations = nullptr);
+    void add(const osmium::Way &way, size_t first, size_t last,
+             const osmium::Location *locations = nullptr);
+    bool full() const;
+    bool empty() const { return mWays.committed() == 0; }
+    size_t capacity() const { return mNodes.capacity() + mWays.capacity(); }
+  };
+
+  // a leaf's output, staged in memory until the staging budget is used up,
+  // then spilled to pbf segments through writers from the pool. Nodes and ways
+  // are only encoded once, segments are joined at the blob level when the leaf
+  // finishes
   struct LockWriter {
 
-    std::shared_ptr<osmium::io::Writer> mWriter;
-    std::shared_ptr<osmium::io::Writer> mWayWriter;
+    fs::path mOutPath;
+    osmium::io::Header mHeader;
+    const LeafOutput *mOutput = nullptr;
+    std::vector<osmium::memory::Buffer> mNodes;
+    std::vector<osmium::memory::Buffer> mWays;
+    size_t mStagedBytes = 0;
+    // nodes and ways spill to segments of their own, each filling blobs
+    size_t mStagedNodes = 0;
+    size_t mStagedWays = 0;
+    StagingBudget *mBudget = nullptr;
+    std::vector<fs::path> mNodeSegments;
+    std::vector<fs::path> mWaySegments;
+    NodeIdSet mWrittenNodes;
+    NodeIdSet mWrittenNegativeNodes;
+    osmium::Box mContentBox;
     std::shared_ptr<std::mutex> mMutex;
-    fs::path mOutWayPath;
+
+    // for the leaf's stats in the config
+    uint64_t mNodeCount = 0;
+    uint64_t mWayCount = 0;
+    uint64_t mSharedWays = 0;
+    uint64_t mWriteNanos = 0;
+
+    // segment writers, open while the leaf is in the pool
+    WriterPool *mPool = nullptr;
+    std::shared_ptr<osmium::io::Writer> mNodeWriter;
+    std::shared_ptr<osmium::io::Writer> mWayWriter;
+    std::list<LockWriter *>::iterator mPoolPos;
+    bool mPooled = false;
+
+    // finished by the run that was resumed
+    bool mDone = false;
 
     LockWriter() {}
-    LockWriter(fs::path outPath, osmium::io::Header &header);
-    void write(osmium::memory::Buffer &buffer, const osmium::Way &way);
-    void putWays();
+    LockWriter(fs::path outPath, const osmium::io::Header &header,
+               const LeafOutput *output, StagingBudget *budget,
+               WriterPool *pool);
+    void write(LeafBatch &batch, WriterStats &stats);
+    void finish(WriterStats &stats);
+    void checkpoint(WriterStats &stats);
+    void resume(const Checkpoint::LeafProgress &progress);
+    LeafStats leafStats() const;
+    void openSegments();
+    void closeSegments();
+
+  protected:
+    bool firstWrite(const osmium::Node &node);
+    std::shared_ptr<osmium::io::Writer> openWriter(const fs::path &path) const;
+    fs::path segmentPath(const char *type, size_t index) const;
+    void spill(WriterStats &stats);
+    void writeSegment(const char *type, std::vector<fs::path> &segments,
+                      std::vector<osmium::memory::Buffer> &buffers);
+    void writeBuffers(osmium::io::Writer &writer,
+                      std::vector<osmium::memory::Buffer> &buffers);
   };
 
-  void write(const fs::path &outFile, osmium::memory::Buffer &buffer,
-             const osmium::Way &way);
+  // a worker's batches by leaf id, created when the leaf first gets a way
+  using LeafBatchList = std::vector<std::unique_ptr<LeafBatch>>;
+
+  // first and last node of a way that a leaf gets when clipping
+  using ClipRange = std::pair<size_t, size_t>;
 
 public:
   OSMSplitWriter(OSMSplitConfigPtr rootConfig, fs::path inputFile,
-                 fs::path outputDirectory, NodeLocatorMap &locStore,
-                 int threads, uint64_t wayCount);
+                 fs::path outputDirectory, NodeLocations &locStore,
+                 WayBoxTable wayBoxes, const SplitOptions &options,
+                 Checkpoint *checkpoint = nullptr);
 
-  void writeWays(uint64_t start, uint64_t num);
+  void readWays(BufferQueue &queue, int numWorkers);
+  void writeWays(BufferQueue &queue);
+  void addNodes(osmium::memory::Buffer &buffer, const osmium::Way &way,
+                const osmium::Location *locations, size_t first = 0,
+                size_t last = SIZE_MAX);
+  static bool clipRange(const osmium::Location *locations, size_t count,
+                        const osmium::Box &box, ClipRange &range);
+  void flushBatches(LeafBatchList &batches);
 
 protected:
-  std::map<fs::path, LockWriter> mWriterMap;
+  void checkpoint(uint64_t waysDone, uint64_t inputOffset);
+  void finishLeaf(size_t leaf);
+  void forEachLeaf(size_t numThreads,
+                   const std::function<void(size_t)> &leafFunc);
+
   fs::path mInputFileName;
-  OSMSplitConfigPtr mRootConfig;
+  OSMSplitTree mTree;
+  std::vector<LockWriter> mWriters;
   OpCounter mOpCount;
-  NodeLocatorMap &mNodeLocatorStore;
+  NodeLocations &mNodeLocatorStore;
+  WayBoxTable mWayBoxes;
+  fs::path mIndexPrefix;
+  std::vector<osmium::unsigned_object_id_type> mWayIds;
+  bool mJoinLocations;
+  bool mClipWays;
+  WriterStats mStats;
+  StagingBudget mBudget;
+  WriterPool mPool;
+  LeafOutput mOutput;
+
+  // null unless checkpointing, ways before mFirstWay were written before the
+  // run resumed from it
+  Checkpoint *mCheckpoint;
+  uint64_t mFirstWay = 0;
+  uint64_t mInputOffset = 0;
+  std::unique_ptr<std::barrier<>> mBarrier;
 };
 
 } // namespace GeoUtils
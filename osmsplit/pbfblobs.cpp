@@ -0,0 +1,72 @@
+#include "pbfblobs.h"
+
+#include <protozero/pbf_reader.hpp>
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace GeoUtils {
+
+// BlobHeader fields from the osm pbf fileformat.proto
+const protozero::pbf_tag_type blobHeaderType = 1;
+const protozero::pbf_tag_type blobHeaderDataSize = 3;
+
+uint64_t appendDataBlobs(const fs::path &pbfFile, std::ostream &out) {
+
+  std::ifstream in(pbfFile, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Failed to open pbf segment " + pbfFile.string());
+  }
+
+  uint64_t count = 0;
+  std::vector<char> header;
+  std::vector<char> blob;
+
+  unsigned char sizeBytes[4];
+  while (in.read(reinterpret_cast<char *>(sizeBytes), 4)) {
+
+    uint32_t headerSize = (uint32_t(sizeBytes[0]) << 24) |
+                          (uint32_t(sizeBytes[1]) << 16) |
+                          (uint32_t(sizeBytes[2]) << 8) | uint32_t(sizeBytes[3]);
+
+    header.resize(headerSize);
+    if (!in.read(header.data(), headerSize)) {
+      throw std::runtime_error("Truncated blob header in " + pbfFile.string());
+    }
+
+    std::string type;
+    int32_t dataSize = 0;
+
+    protozero::pbf_reader reader{header.data(), header.size()};
+    while (reader.next()) {
+      switch (reader.tag()) {
+      case blobHeaderType:
+        type = reader.get_string();
+        break;
+      case blobHeaderDataSize:
+        dataSize = reader.get_int32();
+        break;
+      default:
+        reader.skip();
+      }
+    }
+
+    blob.resize(dataSize);
+    if (!in.read(blob.data(), dataSize)) {
+      throw std::runtime_error("Truncated blob in " + pbfFile.string());
+    }
+
+    if (type == "OSMData") {
+      out.write(reinterpret_cast<char *>(sizeBytes), 4);
+      out.write(header.data(), headerSize);
+      out.write(blob.data(), dataSize);
+      count++;
+    }
+  }
+
+  return count;
+}
+
+} // namespace GeoUtils
@@ -0,0 +1,19 @@
+#ifndef PBF_BLOBS_H
+#define PBF_BLOBS_H
+
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+
+namespace fs = std::filesystem;
+
+namespace GeoUtils {
+
+// copies the OSMData blobs of a pbf file to the end of another stream as they
+// are, without decompressing them, skipping the OSMHeader blob. Returns the
+// number of blobs copied
+uint64_t appendDataBlobs(const fs::path &pbfFile, std::ostream &out);
+
+} // namespace GeoUtils
+
+#endif
@@ -0,0 +1,340 @@
+#ifndef QUAD_HISTOGRAM_H
+#define QUAD_HISTOGRAM_H
+
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+
+namespace GeoUtils {
+
+// sparse density histogram over a box in osmium's fixed point coordinates. A
+// cell is split into quarters once it holds more than the refine limit of
+// samples of the size being added, down to the max depth, so dense areas get
+// fine cells while empty ones stay as a single coarse cell. Counts that
+// arrived before a cell was split are taken as spread evenly over it
+class QuadHistogram {
+public:
+  struct Rect;
+  using PairRect = std::pair<Rect, Rect>;
+
+  // half open [x0, x1) by [y0, y1)
+  struct Rect {
+    int64_t x0, y0, x1, y1;
+
+    int64_t width() const { return x1 - x0; }
+    int64_t height() const { return y1 - y0; }
+    double area() const { return double(width()) * double(height()); }
+
+    PairRect split(int64_t midPoint, bool lon) const {
+
+      PairRect result = PairRect(*this, *this);
+
+      if (lon) {
+        result.first.x1 = midPoint;
+        result.second.x0 = midPoint;
+      } else {
+        result.first.y1 = midPoint;
+        result.second.y0 = midPoint;
+      }
+      return result;
+    }
+  };
+
+  struct Options {
+    uint32_t maxDepth = 20;
+    uint64_t refineLimit = 64;
+  };
+
+  QuadHistogram() : QuadHistogram(osmium::Box(), Options()) {}
+
+  QuadHistogram(const osmium::Box &box, Options options) : mOptions(options) {
+
+    if (box.valid()) {
+      mBounds = {box.bottom_left().x(), box.bottom_left().y(),
+                 int64_t(box.top_right().x()) + 1,
+                 int64_t(box.top_right().y()) + 1};
+    } else {
+      mBounds = {0, 0, 1, 1};
+    }
+    mCells.push_back(Cell());
+  }
+
+  void incr(const osmium::Location &loc, uint64_t count = 1) {
+
+    int64_t x = loc.x();
+    int64_t y = loc.y();
+
+    if (!contains(mBounds, x, y)) {
+      return;
+    }
+
+    uint32_t cell = 0;
+    uint32_t depth = 0;
+    Rect rect = mBounds;
+
+    while (true) {
+
+      mCells[cell].total += count;
+
+      if (mCells[cell].children == 0) {
+
+        if (mCells[cell].own + count <= mOptions.refineLimit * count ||
+            depth >= mOptions.maxDepth || rect.width() < 2 ||
+            rect.height() < 2) {
+          mCells[cell].own += count;
+          return;
+        }
+        refine(cell);
+      }
+
+      uint32_t quadrant = quadrantFor(rect, x, y);
+      rect = quadrantRect(rect, quadrant);
+      cell = mCells[cell].children + quadrant;
+      depth++;
+    }
+  }
+
+  // estimated count inside the rect
+  double count(const Rect &rect) const { return count(0, mBounds, rect); }
+
+  uint64_t total() const { return mCells[0].total; }
+
+  // first position along the axis where the rect's count reaches half its
+  // total, suitable for splitting the rect in two. Found in one descent, the
+  // cells in the column holding the median are halved at each level and
+  // their children's totals tell which half it's in
+  int64_t median(const Rect &rect, bool lon) const {
+
+    double half = count(rect) / 2;
+
+    int64_t lo = lon ? rect.x0 : rect.y0;
+    int64_t hi = lon ? rect.x1 : rect.y1;
+
+    // nothing to split by, or no room for both halves
+    if (half <= 0 || hi - lo < 2) {
+      return lo + (hi - lo) / 2;
+    }
+
+    // the column [a, b) of the rect, the count before it and the count per
+    // unit along the axis inside it, from the cells spread evenly over it
+    int64_t a = std::max(lo, lon ? mBounds.x0 : mBounds.y0);
+    int64_t b = std::min(hi, lon ? mBounds.x1 : mBounds.y1);
+    double before = 0;
+    double density = 0;
+
+    struct ColumnCell {
+      uint32_t cell;
+      Rect rect;
+      bool less;
+    };
+    std::vector<ColumnCell> column{{0, mBounds, true}};
+    std::vector<ColumnCell> children;
+
+    while (!column.empty()) {
+
+      // the cells of a column are all the same width, split on one line
+      const Rect &first = column.front().rect;
+      int64_t mid = lon ? first.x0 + first.width() / 2
+                        : first.y0 + first.height() / 2;
+
+      children.clear();
+      double lessCount = 0;
+
+      for (const auto &entry : column) {
+        const Cell &c = mCells[entry.cell];
+
+        density += c.own * across(entry.rect, rect, lon) / entry.rect.area();
+
+        if (c.children == 0) {
+          continue;
+        }
+        for (uint32_t q = 0; q < 4; q++) {
+          Rect childRect = quadrantRect(entry.rect, q);
+          if (!overlaps(childRect, rect)) {
+            continue;
+          }
+          bool less = lon ? !(q & 1) : !(q & 2);
+          if (less) {
+            lessCount += count(c.children + q, childRect, rect);
+          }
+          children.push_back({c.children + q, childRect, less});
+        }
+      }
+
+      int64_t m = std::clamp(mid, a, b);
+      lessCount += density * (m - a);
+
+      bool less = before + lessCount >= half;
+      if (less) {
+        b = m;
+      } else {
+        before += lessCount;
+        a = m;
+      }
+
+      column.clear();
+      for (const auto &child : children) {
+        if (child.less == less) {
+          column.push_back(child);
+        }
+      }
+    }
+
+    // what's left of the column is spread evenly
+    int64_t pos = b;
+    if (density > 0) {
+      pos = a + int64_t(std::ceil((half - before) / density));
+      pos = std::clamp(pos, a, b);
+    }
+
+    // keep something on both sides of the split where possible
+    return std::max(std::min(pos, hi - 1), lo + 1);
+  }
+
+  // counts per unit area at the point, for drawing the heatmap
+  double density(int64_t x, int64_t y) const {
+
+    if (!contains(mBounds, x, y)) {
+      return 0;
+    }
+
+    double result = 0;
+    uint32_t cell = 0;
+    Rect rect = mBounds;
+
+    while (true) {
+      result += mCells[cell].own / rect.area();
+
+      if (mCells[cell].children == 0) {
+        return result;
+      }
+      uint32_t quadrant = quadrantFor(rect, x, y);
+      rect = quadrantRect(rect, quadrant);
+      cell = mCells[cell].children + quadrant;
+    }
+  }
+
+  // adds the counts of a histogram over the same bounds, refining wherever
+  // the other one has
+  void merge(const QuadHistogram &other) {
+    assert(mBounds.x0 == other.mBounds.x0 && mBounds.y0 == other.mBounds.y0 &&
+           mBounds.x1 == other.mBounds.x1 && mBounds.y1 == other.mBounds.y1);
+    merge(0, other, 0);
+  }
+
+  const Rect &bounds() const { return mBounds; }
+  const Options &options() const { return mOptions; }
+  size_t numCells() const { return mCells.size(); }
+
+protected:
+  struct Cell {
+    uint64_t total = 0;
+    uint64_t own = 0;
+    uint32_t children = 0;
+  };
+
+  static bool contains(const Rect &rect, int64_t x, int64_t y) {
+    return x >= rect.x0 && x < rect.x1 && y >= rect.y0 && y < rect.y1;
+  }
+
+  static bool overlaps(const Rect &a, const Rect &b) {
+    return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+  }
+
+  // how much of the cell the rect covers across the axis
+  static double across(const Rect &cell, const Rect &rect, bool lon) {
+    int64_t from =
+        lon ? std::max(cell.y0, rect.y0) : std::max(cell.x0, rect.x0);
+    int64_t to = lon ? std::min(cell.y1, rect.y1) : std::min(cell.x1, rect.x1);
+    return double(std::max<int64_t>(0, to - from));
+  }
+
+  static uint32_t quadrantFor(const Rect &rect, int64_t x, int64_t y) {
+    int64_t midX = rect.x0 + rect.width() / 2;
+    int64_t midY = rect.y0 + rect.height() / 2;
+    return (x >= midX ? 1 : 0) | (y >= midY ? 2 : 0);
+  }
+
+  static Rect quadrantRect(const Rect &rect, uint32_t quadrant) {
+    int64_t midX = rect.x0 + rect.width() / 2;
+    int64_t midY = rect.y0 + rect.height() / 2;
+
+    Rect result = rect;
+    if (quadrant & 1) {
+      result.x0 = midX;
+    } else {
+      result.x1 = midX;
+    }
+    if (quadrant & 2) {
+      result.y0 = midY;
+    } else {
+      result.y1 = midY;
+    }
+    return result;
+  }
+
+  void refine(uint32_t cell) {
+    uint32_t first = mCells.size();
+    mCells.resize(mCells.size() + 4);
+    mCells[cell].children = first;
+  }
+
+  void merge(uint32_t cell, const QuadHistogram &other, uint32_t otherCell) {
+
+    const Cell &o = other.mCells[otherCell];
+
+    mCells[cell].total += o.total;
+    mCells[cell].own += o.own;
+
+    if (o.children) {
+      if (mCells[cell].children == 0) {
+        refine(cell);
+      }
+      for (uint32_t q = 0; q < 4; q++) {
+        merge(mCells[cell].children + q, other, o.children + q);
+      }
+    }
+  }
+
+  double count(uint32_t cell, const Rect &cellRect, const Rect &rect) const {
+
+    int64_t x0 = std::max(cellRect.x0, rect.x0);
+    int64_t y0 = std::max(cellRect.y0, rect.y0);
+    int64_t x1 = std::min(cellRect.x1, rect.x1);
+    int64_t y1 = std::min(cellRect.y1, rect.y1);
+
+    if (x0 >= x1 || y0 >= y1) {
+      return 0;
+    }
+
+    const Cell &c = mCells[cell];
+
+    if (x0 == cellRect.x0 && y0 == cellRect.y0 && x1 == cellRect.x1 &&
+        y1 == cellRect.y1) {
+      return c.total;
+    }
+
+    double overlap = double(x1 - x0) * double(y1 - y0) / cellRect.area();
+    double result = c.own * overlap;
+
+    if (c.children) {
+      for (uint32_t q = 0; q < 4; q++) {
+        result += count(c.children + q, quadrantRect(cellRect, q), rect);
+      }
+    }
+    return result;
+  }
+
+  Options mOptions;
+  Rect mBounds;
+  std::vector<Cell> mCells;
+};
+
+} // namespace GeoUtils
+
+#endif
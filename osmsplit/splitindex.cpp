@@ -0,0 +1,125 @@
+#include "splitindex.h"
+
+#include <osmium/io/detail/read_write.hpp>
+
+namespace GeoUtils {
+
+template <typename TValue>
+SortedFileIndex<TValue>::SortedFileIndex(const fs::path &file) {
+
+  size_t count = fs::file_size(file) / sizeof(Element);
+  if (count == 0) {
+    return;
+  }
+
+  mFd = osmium::io::detail::open_for_reading(file.string());
+  mMapping = std::make_unique<osmium::util::TypedMemoryMapping<Element>>(
+      count, osmium::util::MemoryMapping::mapping_mode::readonly, mFd, 0);
+}
+
+template <typename TValue> SortedFileIndex<TValue>::~SortedFileIndex() {
+  mMapping.reset();
+  if (mFd >= 0) {
+    osmium::io::detail::reliable_close(mFd);
+  }
+}
+
+template class SortedFileIndex<osmium::Location>;
+template class SortedFileIndex<osmium::Box>;
+
+fs::path SplitIndex::nodesFile(const fs::path &prefix, bool delta) {
+  return prefix.string() + (delta ? ".nodes.delta.idx" : ".nodes.idx");
+}
+
+fs::path SplitIndex::waysFile(const fs::path &prefix, bool delta) {
+  return prefix.string() + (delta ? ".ways.delta.idx" : ".ways.idx");
+}
+
+bool SplitIndex::exists(const fs::path &prefix) {
+  return fs::exists(nodesFile(prefix)) && fs::exists(waysFile(prefix));
+}
+
+void SplitIndex::write(
+    const fs::path &prefix, const NodeLocatorMap &nodes,
+    const std::vector<osmium::unsigned_object_id_type> &wayIds,
+    const WayBoxTable &wayBoxes) {
+
+  SortedFileIndex<osmium::Location>::write(nodesFile(prefix), nodes.cbegin(),
+                                           nodes.cend());
+
+  std::vector<SortedFileIndex<osmium::Box>::Element> ways;
+  ways.reserve(wayIds.size());
+  for (size_t i = 0; i < wayIds.size() && i < wayBoxes.size(); i++) {
+    ways.emplace_back(wayIds[i], wayBoxes[i]);
+  }
+  std::sort(ways.begin(), ways.end(), [](const auto &a, const auto &b) {
+    return a.first < b.first;
+  });
+  SortedFileIndex<osmium::Box>::write(waysFile(prefix), ways.begin(),
+                                      ways.end());
+
+  fs::remove(nodesFile(prefix, true));
+  fs::remove(waysFile(prefix, true));
+}
+
+SplitIndex::SplitIndex(const fs::path &prefix)
+    : mPrefix(prefix), mNodes(nodesFile(prefix)), mWays(waysFile(prefix)) {
+
+  if (fs::exists(nodesFile(prefix, true))) {
+    SortedFileIndex<osmium::Location> delta(nodesFile(prefix, true));
+    for (auto it = delta.cbegin(); it != delta.cend(); ++it) {
+      mNodeDelta[it->first] = it->second;
+    }
+  }
+  if (fs::exists(waysFile(prefix, true))) {
+    SortedFileIndex<osmium::Box> delta(waysFile(prefix, true));
+    for (auto it = delta.cbegin(); it != delta.cend(); ++it) {
+      mWayDelta[it->first] = it->second;
+    }
+  }
+}
+
+osmium::Location
+SplitIndex::location(osmium::unsigned_object_id_type id) const {
+  auto it = mNodeDelta.find(id);
+  return it != mNodeDelta.end() ? it->second : mNodes.get(id);
+}
+
+osmium::Box SplitIndex::wayBox(osmium::unsigned_object_id_type id) const {
+  auto it = mWayDelta.find(id);
+  return it != mWayDelta.end() ? it->second : mWays.get(id);
+}
+
+void SplitIndex::setLocation(osmium::unsigned_object_id_type id,
+                             const osmium::Location &loc) {
+  mNodeDelta[id] = loc;
+}
+
+void SplitIndex::setWayBox(osmium::unsigned_object_id_type id,
+                           const osmium::Box &box) {
+  mWayDelta[id] = box;
+}
+
+void SplitIndex::save() const {
+
+  // written to a temporary file first so a failed save leaves the last delta
+  auto writeDelta = [](const auto &delta, const fs::path &file) {
+    using Element = typename std::decay_t<decltype(delta)>::value_type;
+    std::vector<std::pair<osmium::unsigned_object_id_type,
+                          typename Element::second_type>>
+        sorted(delta.begin(), delta.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+      return a.first < b.first;
+    });
+
+    fs::path tmp = file.string() + ".tmp";
+    SortedFileIndex<typename Element::second_type>::write(tmp, sorted.begin(),
+                                                          sorted.end());
+    fs::rename(tmp, file);
+  };
+
+  writeDelta(mNodeDelta, nodesFile(mPrefix, true));
+  writeDelta(mWayDelta, waysFile(mPrefix, true));
+}
+
+} // namespace GeoUtils
@@ -0,0 +1,119 @@
+#ifndef SPLIT_INDEX_H
+#define SPLIT_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include "main.h"
+
+namespace fs = std::filesystem;
+
+namespace GeoUtils {
+
+// a file of (id, value) pairs sorted by id, mapped read only so a lookup only
+// pages in the part of the file it needs
+template <typename TValue> class SortedFileIndex {
+public:
+  using Element = std::pair<osmium::unsigned_object_id_type, TValue>;
+
+  SortedFileIndex() {}
+  SortedFileIndex(const fs::path &file);
+  ~SortedFileIndex();
+
+  SortedFileIndex(const SortedFileIndex &) = delete;
+  SortedFileIndex &operator=(const SortedFileIndex &) = delete;
+
+  // a default constructed value when the id isn't in the file
+  TValue get(osmium::unsigned_object_id_type id) const {
+
+    auto it = std::lower_bound(
+        cbegin(), cend(), id,
+        [](const Element &e, osmium::unsigned_object_id_type id) {
+          return e.first < id;
+        });
+
+    if (it != cend() && it->first == id) {
+      return it->second;
+    }
+    return TValue();
+  }
+
+  const Element *cbegin() const {
+    return mMapping ? mMapping->cbegin() : nullptr;
+  }
+  const Element *cend() const { return mMapping ? mMapping->cend() : nullptr; }
+  size_t size() const { return mMapping ? mMapping->size() : 0; }
+
+  // writes the elements, which have to be sorted by id already
+  template <typename TIterator>
+  static void write(const fs::path &file, TIterator begin, TIterator end) {
+
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("Failed to write index " + file.string());
+    }
+    for (auto it = begin; it != end; ++it) {
+      Element element(it->first, it->second);
+      out.write(reinterpret_cast<const char *>(&element), sizeof(Element));
+    }
+  }
+
+protected:
+  int mFd = -1;
+  std::unique_ptr<osmium::util::TypedMemoryMapping<Element>> mMapping;
+};
+
+// node locations and way boxes of a split, kept next to its output so change
+// files can be routed to the leaves they touch. Each is a sorted base file
+// written by the split, plus a delta holding everything changed since. The
+// delta is small next to the base, so it's read whole and rewritten on save
+class SplitIndex {
+public:
+  // files are named after the prefix, the output directory and input name
+  SplitIndex(const fs::path &prefix);
+
+  // writes the base files of a new split and drops any old deltas, the
+  // store has to be sorted and the ids and boxes are by way position
+  static void write(const fs::path &prefix, const NodeLocatorMap &nodes,
+                    const std::vector<osmium::unsigned_object_id_type> &wayIds,
+                    const WayBoxTable &wayBoxes);
+
+  static bool exists(const fs::path &prefix);
+
+  // undefined or invalid for ids not known or deleted
+  osmium::Location location(osmium::unsigned_object_id_type id) const;
+  osmium::Box wayBox(osmium::unsigned_object_id_type id) const;
+
+  void setLocation(osmium::unsigned_object_id_type id,
+                   const osmium::Location &loc);
+  void setWayBox(osmium::unsigned_object_id_type id, const osmium::Box &box);
+
+  void save() const;
+
+  static fs::path nodesFile(const fs::path &prefix, bool delta = false);
+  static fs::path waysFile(const fs::path &prefix, bool delta = false);
+
+protected:
+  fs::path mPrefix;
+  SortedFileIndex<osmium::Location> mNodes;
+  SortedFileIndex<osmium::Box> mWays;
+  std::unordered_map<osmium::unsigned_object_id_type, osmium::Location>
+      mNodeDelta;
+  std::unordered_map<osmium::unsigned_object_id_type, osmium::Box> mWayDelta;
+};
+
+} // namespace GeoUtils
+
+#endif
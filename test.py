@@ -3,9 +3,12 @@ import subprocess
 import os
 import create_test_osm_file
 import tempfile
+import json
 import re
 import shutil
 import unittest
+import zlib
+from xml.etree import ElementTree
 import logging
 
 logger = logging.getLogger(__name__)
@@ -25,6 +28,113 @@ def runProcess(args):
   
   return True
 
+def splitLeaves(configFile):
+
+  with open(configFile) as f:
+    config = json.load(f)["osmsplit"]
+
+  def leaves(node):
+    if "splitLess" in node:
+      return leaves(node["splitLess"]) + leaves(node["splitMore"])
+    return [node]
+
+  return leaves(config)
+
+# just enough of the pbf format to check what the leaves hold, the python
+# osmium bindings aren't a dependency
+def readVarint(data, pos):
+  result = shift = 0
+  while True:
+    byte = data[pos]
+    result |= (byte & 0x7f) << shift
+    pos += 1
+    if byte < 0x80:
+      return result, pos
+    shift += 7
+
+def protoFields(data):
+  pos = 0
+  while pos < len(data):
+    key, pos = readVarint(data, pos)
+    field, wire = key >> 3, key & 7
+    if wire == 0:
+      value, pos = readVarint(data, pos)
+    elif wire == 2:
+      size, pos = readVarint(data, pos)
+      value = data[pos:pos + size]
+      pos += size
+    else:
+      size = 8 if wire == 1 else 4
+      value = data[pos:pos + size]
+      pos += size
+    yield field, value
+
+def zigzag(value):
+  return (value >> 1) ^ -(value & 1)
+
+# packed sint64 fields delta coded, as ids, refs and coordinates are
+def packedDeltas(data):
+  pos = total = 0
+  result = []
+  while pos < len(data):
+    value, pos = readVarint(data, pos)
+    total += zigzag(value)
+    result.append(total)
+  return result
+
+# the nodes and ways of a pbf file, ways written with locations on them also
+# have their locations
+def readPbf(fileName):
+
+  result = {"nodes": {}, "ways": {}, "wayLocations": {}, "features": []}
+
+  with open(fileName, "rb") as f:
+    data = f.read()
+
+  pos = 0
+  while pos < len(data):
+    headerSize = int.from_bytes(data[pos:pos + 4], "big")
+    header = dict(protoFields(data[pos + 4:pos + 4 + headerSize]))
+    pos += 4 + headerSize
+    blob = dict(protoFields(data[pos:pos + header[3]]))
+    pos += header[3]
+
+    block = blob[1] if 1 in blob else zlib.decompress(blob[3])
+
+    if header[1] == b"OSMHeader":
+      result["features"] += [value.decode() for field, value in protoFields(block) if field in (4, 5)]
+      continue
+
+    fields = list(protoFields(block))
+    values = dict(fields)
+    granularity = values.get(17, 100)
+    latOffset = zigzag(values.get(19, 0))
+    lonOffset = zigzag(values.get(20, 0))
+
+    def location(lat, lon):
+      return ((latOffset + granularity * lat) / 1e9, (lonOffset + granularity * lon) / 1e9)
+
+    for group in [value for field, value in fields if field == 2]:
+      for field, value in protoFields(group):
+        if field == 1:
+          node = dict(protoFields(value))
+          result["nodes"][zigzag(node[1])] = location(zigzag(node[8]), zigzag(node[9]))
+        elif field == 2:
+          dense = dict(protoFields(value))
+          ids = packedDeltas(dense.get(1, b""))
+          lats = packedDeltas(dense.get(8, b""))
+          lons = packedDeltas(dense.get(9, b""))
+          for id, lat, lon in zip(ids, lats, lons):
+            result["nodes"][id] = location(lat, lon)
+        elif field == 3:
+          way = dict(protoFields(value))
+          result["ways"][way[1]] = packedDeltas(way.get(8, b""))
+          lats = packedDeltas(way.get(9, b""))
+          lons = packedDeltas(way.get(10, b""))
+          result["wayLocations"][way[1]] = [location(lat, lon) for lat, lon in zip(lats, lons)]
+
+  return result
+
 class GeoUtilsProcesses(unittest.TestCase):
 
   @staticmethod
@@ -73,6 +183,459 @@ class GeoUtilsProcesses(unittest.TestCase):
 
     self.assertEqual(len(test_output_files), 16)
 
+  def test_OsmSplitStats(self):
+
+    statsDir = os.path.join(GeoUtilsProcesses.getTestDir(), "stats")
+    os.makedirs(statsDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", statsDir, "-s", "1", "-l", "4"])
+
+    self.assertTrue(result)
+
+    # each leaf's stats are in the config, matching the file written
+    for leaf in splitLeaves(os.path.join(statsDir, "test_conf.json")):
+      leafFile = os.path.join(statsDir, leaf["fileName"] + ".osm.pbf")
+      self.assertEqual(leaf["stats"]["bytes"], os.path.getsize(leafFile))
+
+  def test_OsmSplitIndex(self):
+
+    indexDir = os.path.join(GeoUtilsProcesses.getTestDir(), "index")
+    os.makedirs(indexDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", indexDir, "-s", "1", "-l", "4"])
+
+    self.assertTrue(result)
+
+    # the mapped index is written with the config
+    self.assertTrue(os.path.exists(os.path.join(indexDir, "test_conf.idx")))
+
+  def test_OsmSplitQuery(self):
+
+    queryDir = os.path.join(GeoUtilsProcesses.getTestDir(), "query")
+    os.makedirs(queryDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", queryDir, "-s", "1", "-l", "4"])
+
+    self.assertTrue(result)
+
+    configFile = os.path.join(queryDir, "test_conf.json")
+
+    # the leaves of each query, in the order given
+    def query(args):
+      out = subprocess.run(["osmsplit", "-i", configFile] + args, capture_output=True)
+      self.assertEqual(out.returncode, 0)
+      return [set(group.split()) for group in out.stdout.decode().split("\n\n")]
+
+    def leafBox(leaf):
+      return leaf["extents"]["min"] + leaf["extents"]["max"]
+
+    def boxesOverlap(a, b):
+      return a[0] <= b[2] and a[1] <= b[3] and a[2] >= b[0] and a[3] >= b[1]
+
+    def segmentInBox(a, b, box):
+      t0, t1 = 0.0, 1.0
+      dx, dy = b[0] - a[0], b[1] - a[1]
+      for p, q in ((-dx, a[0] - box[0]), (dx, box[2] - a[0]), (-dy, a[1] - box[1]), (dy, box[3] - a[1])):
+        if p == 0:
+          if q < 0:
+            return False
+        elif p < 0:
+          if q / p > t1:
+            return False
+          t0 = max(t0, q / p)
+        else:
+          if q / p < t0:
+            return False
+          t1 = min(t1, q / p)
+      return True
+
+    def pointInRing(ring, point):
+      inside = False
+      for a, b in zip(ring, ring[-1:] + ring[:-1]):
+        if (a[1] > point[1]) != (b[1] > point[1]):
+          if point[0] < a[0] + (point[1] - a[1]) * (b[0] - a[0]) / (b[1] - a[1]):
+            inside = not inside
+      return inside
+
+    def ringTouchesBox(ring, box):
+      edges = zip(ring, ring[1:] + ring[:1])
+      return any(segmentInBox(a, b, box) for a, b in edges) or pointInRing(ring, box[0:2])
+
+    def expected(touches):
+      return {leaf["fileName"] + ".osm.pbf" for leaf in splitLeaves(configFile) if touches(leafBox(leaf))}
+
+    [minLon, minLat, maxLon, maxLat] = self.getTestCoords()
+    width, height = maxLon - minLon, maxLat - minLat
+
+    def at(x, y):
+      return [minLon + x * width, minLat + y * height]
+
+    # away from the middle, where the splits are
+    boxes = [at(0.07, 0.11) + at(0.31, 0.37), at(0.43, 0.13) + at(0.93, 0.89)]
+    triangle = at(0.07, 0.07) + at(0.63, 0.07) + at(0.07, 0.63)
+    ring = [triangle[i:i + 2] for i in range(0, len(triangle), 2)]
+
+    def commas(coords):
+      return ",".join(str(c) for c in coords)
+
+    found = query(["--query", commas(boxes[0]), "--query", commas(boxes[1]), "--query-polygon", commas(triangle)])
+
+    self.assertEqual(len(found), 3)
+    for box, leaves in zip(boxes, found):
+      self.assertGreater(len(leaves), 0)
+      self.assertEqual(leaves, expected(lambda leafBox: boxesOverlap(leafBox, box)))
+    self.assertEqual(found[2], expected(lambda leafBox: ringTouchesBox(ring, leafBox)))
+
+    # the triangle misses the leaves of the top right corner that its box takes
+    triangleBox = at(0.07, 0.07) + at(0.63, 0.63)
+    self.assertLess(len(found[2]), len(expected(lambda leafBox: boxesOverlap(leafBox, triangleBox))))
+
+    # the index is written again once the config changes
+    with open(configFile) as f:
+      config = json.load(f)
+    node = config["osmsplit"]
+    while "splitLess" in node:
+      node = node["splitLess"]
+    node["fileName"] = "renamed"
+    with open(configFile, "w") as f:
+      json.dump(config, f)
+
+    found = query(["--query", commas(self.getTestCoords())])
+
+    self.assertIn("renamed.osm.pbf", found[0])
+
+  def test_OsmSplitPlan(self):
+
+    planDir = os.path.join(GeoUtilsProcesses.getTestDir(), "plan")
+    os.makedirs(planDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", planDir, "-s", "1", "-l", "4", "--plan"])
+
+    self.assertTrue(result)
+
+    with open(os.path.join(planDir, "test.osm.plan.csv")) as planFile:
+      leaves = planFile.readlines()[1:]
+
+    self.assertEqual(len(leaves), 16)
+
+    # a plan only writes the config, no leaves
+    self.assertTrue(os.path.exists(os.path.join(planDir, "test_conf.json")))
+    self.assertEqual(len([f for f in os.listdir(planDir) if f.endswith(".osm.pbf")]), 0)
+
+    # and splits the same way as a real run with the same options, the ways a
+    # plan samples for its estimates don't change the split
+    runDir = os.path.join(GeoUtilsProcesses.getTestDir(), "planrun")
+    os.makedirs(runDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", runDir, "-s", "1", "-l", "4"])
+
+    self.assertTrue(result)
+
+    # the split without what's only known once the leaves are written
+    def splits(configFile):
+      with open(configFile) as f:
+        config = json.load(f)["osmsplit"]
+
+      def strip(node):
+        node = {key: value for key, value in node.items() if key not in ("contentExtents", "stats")}
+        if "splitLess" in node:
+          node["splitLess"] = strip(node["splitLess"])
+          node["splitMore"] = strip(node["splitMore"])
+        return node
+
+      return strip(config)
+
+    self.assertEqual(splits(os.path.join(planDir, "test_conf.json")), splits(os.path.join(runDir, "test_conf.json")))
+
+  def test_OsmSplitClip(self):
+
+    clipDir = os.path.join(GeoUtilsProcesses.getTestDir(), "clip")
+    os.makedirs(clipDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", clipDir, "-s", "1", "-l", "4", "-c"])
+
+    self.assertTrue(result)
+
+    regex = re.compile('test[0-1]{4}.osm.pbf')
+
+    self.assertEqual(len([f for f in os.listdir(clipDir) if re.match(regex, f)]), 16)
+
+    # the same split unclipped, where the roads crossing leaves take all their
+    # nodes into each one
+    wholeDir = os.path.join(GeoUtilsProcesses.getTestDir(), "noclip")
+    os.makedirs(wholeDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", wholeDir, "-s", "1", "-l", "4"])
+
+    self.assertTrue(result)
+
+    def totalNodes(splitDir):
+      return sum(leaf["stats"]["nodes"] for leaf in splitLeaves(os.path.join(splitDir, "test_conf.json")))
+
+    self.assertLess(totalNodes(clipDir), totalNodes(wholeDir))
+
+  def test_OsmSplitNodeZero(self):
+
+    zeroDir = os.path.join(GeoUtilsProcesses.getTestDir(), "nodezero")
+    os.makedirs(zeroDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", zeroDir, "-s", "1", "-l", "2"])
+
+    self.assertTrue(result)
+
+    # the first road comes after the buildings and starts at node 0, every
+    # leaf it's written to has all its nodes
+    roadId = self.numBuildings
+    found = 0
+    for leaf in splitLeaves(os.path.join(zeroDir, "test_conf.json")):
+      contents = readPbf(os.path.join(zeroDir, leaf["fileName"] + ".osm.pbf"))
+      if roadId not in contents["ways"]:
+        continue
+      found += 1
+      refs = contents["ways"][roadId]
+      self.assertEqual(refs[0], 0)
+      for ref in refs:
+        self.assertIn(ref, contents["nodes"])
+
+    self.assertGreater(found, 0)
+
+  # a new road across the middle of the test area
+  def writeRoadChange(self, changeFile):
+
+    [minLon, minLat, maxLon, maxLat] = self.getTestCoords()
+    midLat = (minLat + maxLat) / 2
+    with open(changeFile, "w") as osc:
+      osc.write(f"""<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6">
+  <create>
+    <node id="9000000001" version="1" lat="{midLat}" lon="{minLon + 0.001}"/>
+    <node id="9000000002" version="1" lat="{midLat}" lon="{maxLon - 0.001}"/>
+    <way id="9000000001" version="1">
+      <nd ref="9000000001"/>
+      <nd ref="9000000002"/>
+      <tag k="highway" v="primary"/>
+    </way>
+  </create>
+</osmChange>
+""")
+
+  def test_OsmSplitApplyChanges(self):
+
+    updateDir = os.path.join(GeoUtilsProcesses.getTestDir(), "update")
+    os.makedirs(updateDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", updateDir, "-s", "1", "-l", "2", "--keep-index"])
+
+    self.assertTrue(result)
+    self.assertTrue(os.path.exists(os.path.join(updateDir, "test.nodes.idx")))
+
+    changeFile = os.path.join(updateDir, "changes.osc")
+    self.writeRoadChange(changeFile)
+    [minLon, minLat, maxLon, maxLat] = self.getTestCoords()
+
+    configFile = os.path.join(updateDir, "test_conf.json")
+    before = {leaf["fileName"]: leaf for leaf in splitLeaves(configFile)}
+
+    result = runProcess(["osmsplit", "-i", configFile, "--apply-changes", changeFile])
+
+    self.assertTrue(result)
+    self.assertTrue(os.path.exists(os.path.join(updateDir, "test.ways.delta.idx")))
+
+    # the leaves the road crosses are rewritten with it and its nodes, and
+    # their content boxes and stats take it in
+    crossed = 0
+    for leaf in splitLeaves(configFile):
+      leafFile = os.path.join(updateDir, leaf["fileName"] + ".osm.pbf")
+      contents = readPbf(leafFile)
+
+      if 9000000001 not in contents["ways"]:
+        continue
+      crossed += 1
+
+      self.assertEqual(contents["ways"][9000000001], [9000000001, 9000000002])
+      self.assertIn(9000000001, contents["nodes"])
+      self.assertIn(9000000002, contents["nodes"])
+
+      content = leaf["contentExtents"]
+      self.assertLessEqual(content["min"][0], minLon + 0.001 + 1e-7)
+      self.assertGreaterEqual(content["max"][0], maxLon - 0.001 - 1e-7)
+
+      self.assertEqual(leaf["stats"]["ways"], before[leaf["fileName"]]["stats"]["ways"] + 1)
+      self.assertEqual(leaf["stats"]["nodes"], len(contents["nodes"]))
+      self.assertEqual(leaf["stats"]["bytes"], os.path.getsize(leafFile))
+
+    self.assertGreater(crossed, 0)
+
+  def test_OsmSplitCheckpoint(self):
+
+    checkpointDir = os.path.join(GeoUtilsProcesses.getTestDir(), "checkpoint")
+    os.makedirs(checkpointDir, exist_ok=True)
+
+    args = ["osmsplit", "-i", self.getTestFile(), "-o", checkpointDir, "-s", "1", "-l", "2", "--checkpoint", "1"]
+
+    result = runProcess(args)
+
+    self.assertTrue(result)
+
+    with open(os.path.join(checkpointDir, "test.checkpoint", "state.json")) as f:
+      self.assertTrue(json.load(f)["finished"])
+
+    # a finished input is skipped on the next run, leaving its leaves alone
+    leafFile = os.path.join(checkpointDir, "test00.osm.pbf")
+    leafTime = os.path.getmtime(leafFile)
+
+    result = runProcess(args)
+
+    self.assertTrue(result)
+    self.assertEqual(os.path.getmtime(leafFile), leafTime)
+
+    # but split again with options that change the leaves
+    result = runProcess(args + ["-c"])
+
+    self.assertTrue(result)
+    self.assertNotEqual(os.path.getmtime(leafFile), leafTime)
+
+  def test_OsmSplitCheckpointResume(self):
+
+    wholeDir = os.path.join(GeoUtilsProcesses.getTestDir(), "uninterrupted")
+    resumeDir = os.path.join(GeoUtilsProcesses.getTestDir(), "resume")
+    os.makedirs(wholeDir, exist_ok=True)
+    os.makedirs(resumeDir, exist_ok=True)
+
+    # an input the reader hands over in several buffers, about 2 MB of xml at
+    # a time, so the run can be stopped part way through its ways. The nodes
+    # go before the ways, as they do in osm files
+    inputFile = os.path.join(resumeDir, "resume.osm")
+    create_test_osm_file.execute(self.getTestCoords(), 0.000025, 10.0, inputFile)
+
+    tree = ElementTree.parse(inputFile)
+    root = tree.getroot()
+    order = {"bounds": 0, "node": 1, "way": 2}
+    root[:] = sorted(root, key=lambda element: order[element.tag])
+    tree.write(inputFile, xml_declaration=True, encoding="utf-8")
+
+    totalWays = len(root.findall("way"))
+
+    args = ["osmsplit", "-i", inputFile, "-s", "1", "-l", "2"]
+
+    result = runProcess(args + ["-o", wholeDir])
+
+    self.assertTrue(result)
+
+    # stopped as if killed while taking the second checkpoint of the writing
+    # pass, with the leaves written past the first and ways left to read
+    resumeArgs = args + ["-o", resumeDir, "--checkpoint-seconds", "0"]
+
+    out = subprocess.run(resumeArgs, capture_output=True, env=dict(os.environ, OSMSPLIT_STOP_AFTER_CHECKPOINTS="1"))
+
+    self.assertNotEqual(out.returncode, 0)
+
+    with open(os.path.join(resumeDir, "resume.checkpoint", "state.json")) as f:
+      state = json.load(f)
+    self.assertFalse(state["finished"])
+    self.assertGreater(state["waysDone"], 0)
+    self.assertLess(state["waysDone"], totalWays)
+
+    out = subprocess.run(resumeArgs, capture_output=True)
+
+    self.assertEqual(out.returncode, 0)
+    self.assertIn(b"Resuming from way", out.stdout)
+
+    # the resumed leaves hold what the uninterrupted ones do
+    for leaf in splitLeaves(os.path.join(wholeDir, "resume_conf.json")):
+      fileName = leaf["fileName"] + ".osm.pbf"
+      whole = readPbf(os.path.join(wholeDir, fileName))
+      resumed = readPbf(os.path.join(resumeDir, fileName))
+      self.assertEqual(resumed["nodes"], whole["nodes"])
+      self.assertEqual(resumed["ways"], whole["ways"])
+
+  def test_OsmSplitUncompressed(self):
+
+    compressedDir = os.path.join(GeoUtilsProcesses.getTestDir(), "compressed")
+    rawDir = os.path.join(GeoUtilsProcesses.getTestDir(), "raw")
+    os.makedirs(compressedDir, exist_ok=True)
+    os.makedirs(rawDir, exist_ok=True)
+
+    args = ["osmsplit", "-i", self.getTestFile(), "-s", "1", "-l", "2"]
+
+    result = runProcess(args + ["-o", compressedDir])
+
+    self.assertTrue(result)
+
+    # no staging memory, so the leaves spill in many small segments
+    result = runProcess(args + ["-o", rawDir, "--compression", "0", "--blob-entities", "100", "-m", "0"])
+
+    self.assertTrue(result)
+
+    for leaf in splitLeaves(os.path.join(compressedDir, "test_conf.json")):
+      fileName = leaf["fileName"] + ".osm.pbf"
+      compressed = readPbf(os.path.join(compressedDir, fileName))
+      raw = readPbf(os.path.join(rawDir, fileName))
+      self.assertEqual(raw["nodes"], compressed["nodes"])
+      self.assertEqual(raw["ways"], compressed["ways"])
+      self.assertGreater(os.path.getsize(os.path.join(rawDir, fileName)), os.path.getsize(os.path.join(compressedDir, fileName)))
+
+    # and libosmium reads them too
+    outputFile = os.path.join(rawDir, "test00.fbx")
+
+    result = runProcess(["osm2assimp", "-i", os.path.join(rawDir, "test00.osm.pbf"), "-o", outputFile])
+
+    self.assertTrue(result)
+    self.assertTrue(os.path.exists(outputFile))
+
+  def test_OsmSplitLocationsOnWays(self):
+
+    lowDir = os.path.join(GeoUtilsProcesses.getTestDir(), "low")
+    os.makedirs(lowDir, exist_ok=True)
+
+    result = runProcess(["osmsplit", "-i", self.getTestFile(), "-o", lowDir, "-s", "1", "-l", "2", "--locations-on-ways", "--keep-index"])
+
+    self.assertTrue(result)
+
+    regex = re.compile('test[0-1]{2}.osm.pbf')
+
+    self.assertEqual(len([f for f in os.listdir(lowDir) if re.match(regex, f)]), 4)
+
+    # only ways, each with the locations of all its nodes
+    def assertLocationsOnWays(leafFile):
+      contents = readPbf(leafFile)
+      self.assertIn("LocationsOnWays", contents["features"])
+      self.assertEqual(len(contents["nodes"]), 0)
+      self.assertGreater(len(contents["ways"]), 0)
+      for id, refs in contents["ways"].items():
+        self.assertEqual(len(contents["wayLocations"][id]), len(refs))
+      return contents
+
+    for leaf in splitLeaves(os.path.join(lowDir, "test_conf.json")):
+      assertLocationsOnWays(os.path.join(lowDir, leaf["fileName"] + ".osm.pbf"))
+
+    # the leaves are read without a location index
+    outputFile = os.path.join(lowDir, "test00.fbx")
+
+    out = subprocess.run(["osm2assimp", "-i", os.path.join(lowDir, "test00.osm.pbf"), "-o", outputFile], capture_output=True)
+
+    self.assertEqual(out.returncode, 0)
+    self.assertTrue(os.path.exists(outputFile))
+
+    exported = re.search(rb"Ways Exported: (\d+)", out.stdout)
+    self.assertIsNotNone(exported)
+    self.assertGreater(int(exported.group(1)), 0)
+
+    # and keep their format when changes are applied
+    changeFile = os.path.join(lowDir, "changes.osc")
+    self.writeRoadChange(changeFile)
+
+    result = runProcess(["osmsplit", "-i", os.path.join(lowDir, "test_conf.json"), "--apply-changes", changeFile])
+
+    self.assertTrue(result)
+
+    crossed = 0
+    for leaf in splitLeaves(os.path.join(lowDir, "test_conf.json")):
+      contents = assertLocationsOnWays(os.path.join(lowDir, leaf["fileName"] + ".osm.pbf"))
+      crossed += 9000000001 in contents["ways"]
+
+    self.assertGreater(crossed, 0)
+
   def test_SplitS2Cells(self):
 
     result = runProcess(["osms2split", "-i", self.getTestFile(), "-o", GeoUtilsProcesses.getTestDir(), "-l", "12"])